@@ -57,14 +57,18 @@
 #define UTIL_WEIGHT .60
 
 /* 
- * Alignment requirement in bytes (either 4 or 8) 
+ * Alignment requirement in bytes (4, 8, or 16 for libmm.so)
  */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
 
 /* 
  * Maximum heap size in bytes 
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -85,6 +85,8 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    size_t heap;     /* peak heap plus mapped bytes during the util run */
+    size_t resident; /* bytes still resident once the util run ends */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -306,6 +308,8 @@ int main(int argc, char **argv)
 	    if (verbose > 1)
 		printf("efficiency, ");
 	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].heap = mem_peak_footprint();
+	    mm_stats[i].resident = mem_resident_bytes();
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
@@ -403,9 +407,10 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of a mapping */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -696,11 +701,9 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   Utilization is the ratio hwm/footprint, where footprint is the 
+ *   largest heap size plus memory given out by mem_map() seen while
+ *   running the student's malloc package on the trace.
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
@@ -713,8 +716,10 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     char *p;
     char *newp, *oldp;
 
-    /* initialize the heap and the mm malloc package */
-    mem_reset_brk();
+    /* initialize the heap and the mm malloc package. The timed runs
+     * leave the heap dirty, so it starts cold here for the footprint and
+     * resident counts. */
+    mem_release_heap();
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
@@ -782,7 +787,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_footprint());
 }
 
 
@@ -934,17 +939,23 @@ static void printresults(int n, stats_t *stats)
     double util = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%8s%10s%6s%8s%8s\n", 
+	   "trace", " valid", "util", "ops", "secs", "Kops", "heapK", "rssK");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
+	    if (stats[i].heap > 0)
+		printf("%8lu%8lu\n", 
+		       (unsigned long)(stats[i].heap / 1024),
+		       (unsigned long)(stats[i].resident / 1024));
+	    else
+		printf("%8s%8s\n", "-", "-");
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
@@ -0,0 +1,328 @@
+/*
+ * memlib-sys.c - the memlib interface backed by the real memory system,
+ *            for running mm as the process malloc (see preload.c).
+ *            The heap is MAX_HEAP bytes of address space reserved up
+ *            front and made accessible page by page as mem_sbrk grows
+ *            it, so it costs nothing until it is used. Nothing in here
+ *            may call malloc: mappings keep no records, and the calls
+ *            that need them in memlib.c work from the arguments alone.
+ */
+#define _GNU_SOURCE             /* for mremap */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+
+#include "memlib.h"
+#include "config.h"
+
+/* private variables */
+static char *mem_start_brk;  /* points to first byte of heap */
+static char *mem_brk;        /* points to last byte of heap */
+static char *mem_max_addr;   /* largest legal heap address */
+static char *mem_top;        /* highest brk since the last reset */
+static char *mem_commit;     /* end of the accessible part of the heap */
+static size_t mem_mapped;    /* bytes currently mapped */
+static size_t mem_peak;      /* largest heap size plus mapped bytes seen */
+
+/* records a new footprint high water mark, if it is one */
+static void update_peak(void)
+{
+    size_t footprint = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+
+    if (footprint > mem_peak)
+        mem_peak = footprint;
+}
+
+/* rounds size up to whole pages */
+static size_t page_roundup(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+
+    return (size + pagesize - 1) & ~(pagesize - 1);
+}
+
+/* hands the whole pages inside lo..hi back to the system; they read
+ * back as zeros the next time they are touched */
+static void release_pages(char *lo, char *hi)
+{
+    size_t pagesize = mem_pagesize();
+
+    lo = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+    hi = (char *)((size_t)hi & ~(pagesize - 1));
+    if (lo < hi && madvise(lo, hi - lo, MADV_DONTNEED))
+        perror("madvise");
+}
+
+/*
+ * mem_init - reserves the address space of the heap. use_mmap is
+ *    ignored, the heap is always a mapping.
+ */
+void mem_init(int use_mmap)
+{
+    mem_start_brk = mmap(NULL, MAX_HEAP, PROT_NONE,
+                         MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+        perror("mem_init: mmap");
+        abort();
+    }
+    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_top = mem_start_brk;
+    mem_commit = mem_start_brk;
+}
+
+/*
+ * mem_deinit - gives the heap's address space back
+ */
+void mem_deinit(void)
+{
+    if (munmap(mem_start_brk, MAX_HEAP))
+        perror("munmap");
+}
+
+/*
+ * mem_reset_brk - empties the heap, leaving its pages as they were.
+ *    Mappings are not tracked, so unlike memlib.c it leaves them alone.
+ */
+void mem_reset_brk()
+{
+    mem_brk = mem_start_brk;
+    mem_peak = 0;
+}
+
+/*
+ * mem_release_heap - mem_reset_brk that also releases the heap's pages,
+ *    so they read as zeros again
+ */
+void mem_release_heap()
+{
+    release_pages(mem_start_brk, mem_commit);
+    mem_top = mem_start_brk;
+    mem_reset_brk();
+}
+
+/*
+ * mem_sbrk - extends the heap by incr bytes and returns the start
+ *    address of the new area, making its pages accessible the first
+ *    time the heap reaches them. A negative incr shrinks the heap, and
+ *    the whole pages it gives up are handed back to the system. Memory
+ *    above mem_heap_fresh() reads as zeros.
+ */
+void *mem_sbrk(intptr_t incr)
+{
+    char *old_brk = mem_brk;
+    char *commit;
+
+    if (incr < mem_start_brk - mem_brk) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (incr > mem_max_addr - mem_brk) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (mem_brk + incr > mem_commit) {
+        commit = mem_start_brk + page_roundup(mem_brk + incr - mem_start_brk);
+        if (mprotect(mem_commit, commit - mem_commit, PROT_READ|PROT_WRITE)) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        mem_commit = commit;
+    }
+    mem_brk += incr;
+    if (incr < 0)
+        release_pages(mem_brk, old_brk);
+    if (mem_brk > mem_top)
+        mem_top = mem_brk;
+    update_peak();
+    return (void *)old_brk;
+}
+
+/*
+ * mem_map - gives out a fresh anonymous mapping of size bytes, rounded up
+ *    to whole pages, outside the heap. Returns NULL if the system refuses.
+ */
+void *mem_map(size_t size)
+{
+    return mem_map_aligned(size, mem_pagesize(), 0);
+}
+
+/*
+ * mem_map_aligned - like mem_map, but places the mapping so that its start
+ *    plus offset is a multiple of align. align is a power of 2 and offset a
+ *    multiple of the page size. The extra room needed to line it up is
+ *    handed straight back to the system.
+ */
+void *mem_map_aligned(size_t size, size_t align, size_t offset)
+{
+    size_t pagesize = mem_pagesize();
+    size_t slack = align > pagesize ? align : 0;
+    char *raw, *p;
+
+    assert(offset % pagesize == 0);
+    size = page_roundup(size);
+    raw = mmap(NULL, size + slack, PROT_READ|PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+    p = raw;
+    if (slack > 0) {
+        p = (char *)((((size_t)raw + offset + align - 1) & ~(align - 1)) - offset);
+        if (p > raw && munmap(raw, p - raw))
+            perror("munmap");
+        if (p + size < raw + size + slack && munmap(p + size, raw + slack - p))
+            perror("munmap");
+    }
+    mem_mapped += size;
+    update_peak();
+    return p;
+}
+
+/*
+ * mem_unmap - releases a whole mapping given out by mem_map
+ */
+void mem_unmap(void *ptr, size_t size)
+{
+    size = page_roundup(size);
+    if (munmap(ptr, size))
+        perror("munmap");
+    mem_mapped -= size;
+}
+
+/*
+ * mem_remap - resizes a mapping given out by mem_map to new_size bytes,
+ *    rounded up to whole pages. The system may move it, taking its pages
+ *    along instead of copying them. Returns the new start of the mapping,
+ *    or NULL with the mapping untouched.
+ */
+void *mem_remap(void *ptr, size_t old_size, size_t new_size)
+{
+    void *p;
+
+    old_size = page_roundup(old_size);
+    new_size = page_roundup(new_size);
+    p = mremap(ptr, old_size, new_size, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+        return NULL;
+    mem_mapped = mem_mapped - old_size + new_size;
+    update_peak();
+    return p;
+}
+
+/*
+ * mem_is_mapped - returns true if the bytes lo..hi lie in mapped memory
+ *    outside the heap
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    size_t pagesize = mem_pagesize();
+    char *plo = (char *)((size_t)lo & ~(pagesize - 1));
+    unsigned char vec;
+
+    if ((char *)hi >= mem_start_brk && (char *)lo < mem_max_addr)
+        return 0;
+    /* mincore fails on any page that isn't mapped */
+    for (; plo <= (char *)hi; plo += pagesize)
+        if (mincore(plo, pagesize, &vec))
+            return 0;
+    return 1;
+}
+
+/*
+ * mem_mapped_bytes - returns the number of bytes currently mapped
+ */
+size_t mem_mapped_bytes()
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_peak_footprint - returns the largest heap size plus mapped bytes
+ *    seen since the last mem_reset_brk
+ */
+size_t mem_peak_footprint()
+{
+    return mem_peak;
+}
+
+/*
+ * mem_purge - hands the whole pages inside ptr..ptr+size back to the
+ *    system without giving up the address range. They read back as
+ *    zeros when next touched.
+ */
+void mem_purge(void *ptr, size_t size)
+{
+    release_pages(ptr, (char *)ptr + size);
+}
+
+/*
+ * mem_resident_bytes - returns how many bytes of the heap are backed by
+ *    physical memory, counting whole pages only. Mappings aren't tracked,
+ *    so they aren't counted.
+ */
+size_t mem_resident_bytes()
+{
+    size_t pagesize = mem_pagesize();
+    size_t bytes = 0;
+    unsigned char vec[256];
+    size_t n, i;
+    char *p;
+
+    for (p = mem_start_brk; p < mem_commit; p += n * pagesize) {
+        n = (mem_commit - p) / pagesize;
+        if (n > sizeof(vec))
+            n = sizeof(vec);
+        if (mincore(p, n * pagesize, vec)) {
+            perror("mincore");
+            break;
+        }
+        for (i = 0; i < n; i++)
+            if (vec[i] & 1)
+                bytes += pagesize;
+    }
+    return bytes;
+}
+
+/*
+ * mem_heap_fresh - returns the highest brk since the last mem_release_heap.
+ *    Heap memory from there up has never been handed out, and reads as zeros.
+ */
+void *mem_heap_fresh()
+{
+    return (void *)mem_top;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo()
+{
+    return (void *)mem_start_brk;
+}
+
+/*
+ * mem_heap_hi - return address of last heap byte
+ */
+void *mem_heap_hi()
+{
+    return (void *)(mem_brk - 1);
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes
+ */
+size_t mem_heapsize()
+{
+    return (size_t)(mem_brk - mem_start_brk);
+}
+
+/*
+ * mem_pagesize() - returns the page size of the system
+ */
+size_t mem_pagesize()
+{
+    return (size_t)getpagesize();
+}
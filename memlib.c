@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE             /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -18,9 +19,57 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_top;        /* highest brk since the last reset */
 static int use_mmap;         /* Use mmap instead of malloc */
 static void * mmap_addr = (void *)0x58000000;
 
+/* regions handed out by mem_map, outside the modeled heap */
+struct mapping {
+    char *lo;
+    size_t size;
+    struct mapping *next;
+};
+static struct mapping *mappings;
+static size_t mem_mapped;    /* bytes currently mapped */
+static size_t mem_peak;      /* largest heap size plus mapped bytes seen */
+
+/* records a new footprint high water mark, if it is one */
+static void update_peak(void)
+{
+    size_t footprint = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+
+    if (footprint > mem_peak)
+        mem_peak = footprint;
+}
+
+/* hands the whole pages inside lo..hi back to the system; they read
+ * back as zeros the next time they are touched */
+static void release_pages(char *lo, char *hi)
+{
+    size_t pagesize = mem_pagesize();
+
+    lo = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+    hi = (char *)((size_t)hi & ~(pagesize - 1));
+    if (lo < hi && madvise(lo, hi - lo, MADV_DONTNEED))
+        perror("madvise");
+}
+
+/* makes the bytes lo..hi read as zeros, releasing the whole pages among them */
+static void clear_range(char *lo, char *hi)
+{
+    size_t pagesize = mem_pagesize();
+    char *plo = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+    char *phi = (char *)((size_t)hi & ~(pagesize - 1));
+
+    if (plo >= phi) {
+        memset(lo, 0, hi - lo);
+        return;
+    }
+    memset(lo, 0, plo - lo);
+    memset(phi, 0, hi - phi);
+    release_pages(plo, phi);
+}
+
 /* 
  * mem_init - initialize the memory system model
  */
@@ -44,7 +93,7 @@ void mem_init(int _use_mmap)
             exit(1);
         }
     } else {
-        if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+        if ((mem_start_brk = (char *)calloc(1, MAX_HEAP)) == NULL) {
             fprintf(stderr, "mem_init_vm: malloc error\n");
             exit(1);
         }
@@ -52,6 +101,7 @@ void mem_init(int _use_mmap)
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_top = mem_start_brk;
 }
 
 /* 
@@ -68,31 +118,255 @@ void mem_deinit(void)
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and drop any mappings left over from the previous run. The old heap
+ *    is left as it was, so this stays cheap enough to time.
  */
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    while (mappings != NULL)
+        mem_unmap(mappings->lo, mappings->size);
+    mem_peak = 0;
+}
+
+/*
+ * mem_release_heap - mem_reset_brk that also clears everything the old
+ *    heap touched and releases its pages, so the next run starts with a
+ *    zeroed heap and nothing resident.
+ */
+void mem_release_heap()
+{
+    clear_range(mem_start_brk, mem_top);
+    mem_top = mem_start_brk;
+    mem_reset_brk();
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. 
+ *    A negative incr shrinks the heap, and the whole pages it gives
+ *    up are handed back to the system. Like the real sbrk, memory above
+ *    mem_heap_fresh() reads as zeros.
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk(intptr_t incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (incr < mem_start_brk - mem_brk) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap start...\n");
+	return NULL;
+    }
+    if (incr > mem_max_addr - mem_brk) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return NULL;
     }
     mem_brk += incr;
+    if (incr < 0)
+        release_pages(mem_brk, old_brk);
+    if (mem_brk > mem_top)
+        mem_top = mem_brk;
+    update_peak();
     return (void *)old_brk;
 }
 
+/*
+ * mem_map - gives out a fresh anonymous mapping of size bytes, rounded up
+ *    to whole pages, outside the heap. Returns NULL if the system refuses.
+ */
+void *mem_map(size_t size)
+{
+    return mem_map_aligned(size, mem_pagesize(), 0);
+}
+
+/*
+ * mem_map_aligned - like mem_map, but places the mapping so that its start
+ *    plus offset is a multiple of align. align is a power of 2 and offset a
+ *    multiple of the page size. The extra room needed to line it up is
+ *    handed straight back to the system.
+ */
+void *mem_map_aligned(size_t size, size_t align, size_t offset)
+{
+    size_t pagesize = mem_pagesize();
+    size_t slack = align > pagesize ? align : 0;
+    struct mapping *m;
+    char *raw, *p;
+
+    assert(offset % pagesize == 0);
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+    if ((m = malloc(sizeof(*m))) == NULL)
+        return NULL;
+    raw = mmap(NULL, size + slack, PROT_READ|PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (raw == MAP_FAILED) {
+        free(m);
+        fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+        return NULL;
+    }
+    p = raw;
+    if (slack > 0) {
+        p = (char *)((((size_t)raw + offset + align - 1) & ~(align - 1)) - offset);
+        if (p > raw && munmap(raw, p - raw))
+            perror("munmap");
+        if (p + size < raw + size + slack && munmap(p + size, raw + slack - p))
+            perror("munmap");
+    }
+    m->lo = p;
+    m->size = size;
+    m->next = mappings;
+    mappings = m;
+    mem_mapped += size;
+    update_peak();
+    return p;
+}
+
+/*
+ * mem_unmap - releases a whole mapping given out by mem_map
+ */
+void mem_unmap(void *ptr, size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    struct mapping **mp;
+    struct mapping *m;
+
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+    for (mp = &mappings; (m = *mp) != NULL; mp = &m->next) {
+        if (m->lo == ptr) {
+            assert(m->size == size);
+            if (munmap(ptr, size))
+                perror("munmap");
+            mem_mapped -= size;
+            *mp = m->next;
+            free(m);
+            return;
+        }
+    }
+    assert(!"mem_unmap: not a mapping");
+}
+
+/*
+ * mem_remap - resizes a mapping given out by mem_map to new_size bytes,
+ *    rounded up to whole pages. The system may move it, taking its pages
+ *    along instead of copying them. Returns the new start of the mapping,
+ *    or NULL with the mapping untouched.
+ */
+void *mem_remap(void *ptr, size_t old_size, size_t new_size)
+{
+    size_t pagesize = mem_pagesize();
+    struct mapping *m;
+    void *p;
+
+    old_size = (old_size + pagesize - 1) & ~(pagesize - 1);
+    new_size = (new_size + pagesize - 1) & ~(pagesize - 1);
+    for (m = mappings; m != NULL; m = m->next) {
+        if (m->lo == ptr) {
+            assert(m->size == old_size);
+            p = mremap(ptr, old_size, new_size, MREMAP_MAYMOVE);
+            if (p == MAP_FAILED) {
+                fprintf(stderr, "ERROR: mem_remap failed. Ran out of memory...\n");
+                return NULL;
+            }
+            m->lo = p;
+            m->size = new_size;
+            mem_mapped = mem_mapped - old_size + new_size;
+            update_peak();
+            return p;
+        }
+    }
+    assert(!"mem_remap: not a mapping");
+    return NULL;
+}
+
+/*
+ * mem_is_mapped - returns true if the bytes lo..hi lie in one mapping
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    struct mapping *m;
+
+    for (m = mappings; m != NULL; m = m->next)
+        if ((char *)lo >= m->lo && (char *)hi < m->lo + m->size)
+            return 1;
+    return 0;
+}
+
+/*
+ * mem_mapped_bytes - returns the number of bytes currently mapped
+ */
+size_t mem_mapped_bytes()
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_peak_footprint - returns the largest heap size plus mapped bytes
+ *    seen since the last mem_reset_brk
+ */
+size_t mem_peak_footprint()
+{
+    return mem_peak;
+}
+
+/*
+ * mem_purge - hands the whole pages inside ptr..ptr+size back to the
+ *    system without giving up the address range. They read back as
+ *    zeros when next touched.
+ */
+void mem_purge(void *ptr, size_t size)
+{
+    release_pages(ptr, (char *)ptr + size);
+}
+
+/* adds the resident bytes among the whole pages inside lo..hi */
+static size_t resident_pages(char *lo, char *hi)
+{
+    size_t pagesize = mem_pagesize();
+    size_t npages, i, bytes = 0;
+    unsigned char *vec;
+
+    lo = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+    hi = (char *)((size_t)hi & ~(pagesize - 1));
+    if (lo >= hi)
+        return 0;
+    npages = (hi - lo) / pagesize;
+    if ((vec = malloc(npages)) == NULL)
+        return 0;
+    if (mincore(lo, hi - lo, vec) == 0) {
+        for (i = 0; i < npages; i++)
+            if (vec[i] & 1)
+                bytes += pagesize;
+    } else {
+        perror("mincore");
+    }
+    free(vec);
+    return bytes;
+}
+
+/*
+ * mem_resident_bytes - returns how many bytes of the heap and of the
+ *    current mappings are backed by physical memory, counting whole
+ *    pages only
+ */
+size_t mem_resident_bytes()
+{
+    struct mapping *m;
+    size_t bytes = resident_pages(mem_start_brk, mem_brk);
+
+    for (m = mappings; m != NULL; m = m->next)
+        bytes += resident_pages(m->lo, m->lo + m->size);
+    return bytes;
+}
+
+/*
+ * mem_heap_fresh - returns the highest brk since the last mem_release_heap.
+ *    Heap memory from there up has never been handed out, and reads as zeros.
+ */
+void *mem_heap_fresh()
+{
+    return (void *)mem_top;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -1,11 +1,23 @@
 #include <unistd.h>
+#include <stdint.h>
 
 void mem_init(int use_mmap);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
+void mem_release_heap(void);
+void *mem_heap_fresh(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+void *mem_map(size_t size);
+void *mem_map_aligned(size_t size, size_t align, size_t offset);
+void mem_unmap(void *ptr, size_t size);
+void *mem_remap(void *ptr, size_t old_size, size_t new_size);
+int mem_is_mapped(void *lo, void *hi);
+size_t mem_mapped_bytes(void);
+size_t mem_peak_footprint(void);
+void mem_purge(void *ptr, size_t size);
+size_t mem_resident_bytes(void);
 
@@ -0,0 +1,584 @@
+/*
+ * Simple, 32-bit and 64-bit clean allocator based on boundary tag
+ * coalescing and best fit placement. Free blocks smaller than TREE_MIN
+ * bytes are kept on one doubly-linked list per size, larger ones in a
+ * red-black tree ordered by size and then by address, so every key is
+ * unique and the best fit for a large request is found in O(log n).
+ *
+ * Every block has a one-word header and footer holding its size, with
+ * the inuse bit in the low bit. Headers sit one word below an ALIGNMENT
+ * boundary, so payloads are ALIGNMENT aligned.
+ *
+ * This is the kind of r/b tree-based allocator config.h's AVG_LIBC_THRUPUT
+ * refers to, kept here as a reference point for mm.c.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "list.h"
+#include "config.h"
+
+#define WSIZE       sizeof(size_t)      /* Header/footer size (bytes) */
+#define CHUNKSIZE   (1<<12)             /* Extend heap by at least this amount (bytes) */
+#define TREE_MIN    (1<<9)              /* Free blocks of at least this size go in the tree */
+#define NUM_LISTS   (TREE_MIN / ALIGNMENT)
+
+#define MAX(x, y) ((x) > (y)? (x) : (y))
+
+/* A node of the tree of large free blocks, kept in their payload */
+struct rb_node {
+    struct rb_node *left;
+    struct rb_node *right;
+    struct rb_node *parent;
+    bool red;
+};
+
+/* A C struct describing the beginning of each block.
+ * Free blocks use the payload for their list_elem or rb_node. */
+struct block {
+    size_t header;              /* size | inuse */
+    union {
+        struct list_elem elem;  /* free blocks below TREE_MIN */
+        struct rb_node node;    /* free blocks of TREE_MIN or more */
+        char payload[0];
+    };
+};
+
+/* Smallest block: header, list_elem and footer */
+#define MIN_BLOCK_SIZE \
+    ((offsetof(struct block, payload) + sizeof(struct list_elem) + WSIZE + ALIGNMENT - 1) \
+     & ~(size_t) (ALIGNMENT - 1))
+
+/* Global variables */
+static struct block *heap_listp = 0;            /* Pointer to the epilogue at init */
+static struct list free_lists[NUM_LISTS];       /* Exact size lists, index size / ALIGNMENT */
+static struct rb_node *tree_root;
+
+/* Function prototypes for internal helper routines */
+static struct block *extend_heap(size_t size);
+static void place(struct block *bp, size_t asize);
+static struct block *find_fit(size_t asize);
+static struct block *coalesce(struct block *bp);
+static void insert_free(struct block *bp);
+static void remove_free(struct block *bp);
+
+/* Return size of block, header and footer included */
+static size_t blk_size(struct block *blk) {
+    return blk->header & ~(size_t) 1;
+}
+
+/* Return if block is free */
+static bool blk_free(struct block *blk) {
+    return !(blk->header & 1);
+}
+
+/* Given a block, obtain previous's block footer.
+   Works for left-most block also. */
+static size_t *prev_blk_footer(struct block *blk) {
+    return &blk->header - 1;
+}
+
+/* Given a block, obtain pointer to previous block.
+   Not meaningful for left-most block. */
+static struct block *prev_blk(struct block *blk) {
+    size_t *prevfooter = prev_blk_footer(blk);
+    assert((*prevfooter & ~(size_t) 1) != 0);
+    return (struct block *)((char *)blk - (*prevfooter & ~(size_t) 1));
+}
+
+/* Given a block, obtain pointer to next block.
+   Not meaningful for right-most block. */
+static struct block *next_blk(struct block *blk) {
+    assert(blk_size(blk) != 0);
+    return (struct block *)((char *)blk + blk_size(blk));
+}
+
+/* Set a block's size and inuse bit in header and footer */
+static void set_header_and_footer(struct block *blk, size_t size, int inuse) {
+    blk->header = size | inuse;
+    *(size_t *)((char *)blk + size - WSIZE) = blk->header;
+}
+
+/* Given a payload pointer, obtain its block */
+static struct block *blk_from_payload(void *bp) {
+    return (struct block *)((char *)bp - offsetof(struct block, payload));
+}
+
+/* Given a tree node, obtain its block */
+static struct block *blk_from_node(struct rb_node *node) {
+    return (struct block *)((char *)node - offsetof(struct block, node));
+}
+
+/* Return adjusted block size for a request of size bytes */
+static size_t adjust_size(size_t size) {
+    size = (size + 2 * WSIZE + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+    return MAX(size, MIN_BLOCK_SIZE);
+}
+
+/*
+ * mm_init - Initialize the memory manager
+ */
+int mm_init(void)
+{
+    size_t initsize = (2 * WSIZE + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+    size_t *initial;
+    struct block *bp;
+    int i;
+
+    /* Create the initial empty heap: a prologue footer followed by the
+     * epilogue header, which sits one word below an ALIGNMENT boundary */
+    initial = mem_sbrk(initsize);
+    if (initial == NULL)
+        return -1;
+    heap_listp = (struct block *)((char *)initial + initsize - WSIZE);
+    *prev_blk_footer(heap_listp) = 1;   /* Prologue footer */
+    heap_listp->header = 1;             /* Epilogue header */
+
+    for (i = 0; i < NUM_LISTS; i++)
+        list_init(&free_lists[i]);
+    tree_root = NULL;
+
+    /* Extend the empty heap with a free block of CHUNKSIZE bytes */
+    if ((bp = extend_heap(CHUNKSIZE)) == NULL)
+        return -1;
+    insert_free(bp);
+    return 0;
+}
+
+/*
+ * mm_malloc - Allocate a block with at least size bytes of payload
+ */
+void *mm_malloc(size_t size)
+{
+    size_t asize;       /* Adjusted block size */
+    struct block *bp;
+
+    if (heap_listp == 0){
+        mm_init();
+    }
+    /* Ignore spurious requests */
+    if (size == 0)
+        return NULL;
+
+    asize = adjust_size(size);
+
+    /* Search the free lists and tree for a fit */
+    if ((bp = find_fit(asize)) != NULL) {
+        place(bp, asize);
+        return bp->payload;
+    }
+
+    /* No fit found. Get more memory and place the block */
+    if ((bp = extend_heap(MAX(asize, CHUNKSIZE))) == NULL)
+        return NULL;
+    place(bp, asize);
+    return bp->payload;
+}
+
+/*
+ * mm_free - Free a block
+ */
+void mm_free(void *bp)
+{
+    struct block *blk;
+
+    if (bp == 0)
+        return;
+    if (heap_listp == 0) {
+        mm_init();
+    }
+
+    blk = blk_from_payload(bp);
+    set_header_and_footer(blk, blk_size(blk), 0);
+    insert_free(coalesce(blk));
+}
+
+/*
+ * mm_realloc - Grow into a free next block if possible, else move the block
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+    size_t oldsize;
+    size_t asize;
+    struct block *blk;
+    struct block *next;
+    void *newptr;
+
+    /* If size == 0 then this is just free, and we return NULL. */
+    if(size == 0) {
+        mm_free(ptr);
+        return 0;
+    }
+
+    /* If oldptr is NULL, then this is just malloc. */
+    if(ptr == NULL) {
+        return mm_malloc(size);
+    }
+
+    blk = blk_from_payload(ptr);
+    asize = adjust_size(size);
+    if (asize <= blk_size(blk))
+        return ptr;
+
+    next = next_blk(blk);
+    if (blk_free(next) && blk_size(blk) + blk_size(next) >= asize) {
+        remove_free(next);
+        set_header_and_footer(blk, blk_size(blk) + blk_size(next), 1);
+        return ptr;
+    }
+
+    newptr = mm_malloc(size);
+
+    /* If realloc() fails the original block is left untouched  */
+    if(!newptr) {
+        return 0;
+    }
+
+    /* Copy the old data. */
+    oldsize = blk_size(blk) - 2 * WSIZE;
+    if(size < oldsize) oldsize = size;
+    memcpy(newptr, ptr, oldsize);
+
+    /* Free the old block. */
+    mm_free(ptr);
+
+    return newptr;
+}
+
+/*
+ * checkheap - We don't check anything right now.
+ */
+void mm_checkheap(int verbose)
+{
+}
+
+/*
+ * The remaining routines are internal helper routines
+ */
+
+/*
+ * extend_heap - Extend heap with free block and return it, off the free lists
+ */
+static struct block *extend_heap(size_t size)
+{
+    void *bp;
+
+    if ((bp = mem_sbrk(size)) == NULL)
+        return NULL;
+
+    /* Initialize free block header/footer and the epilogue header.
+     * Note that we scoop up the previous epilogue here. */
+    struct block * blk = (struct block *)((char *)bp - WSIZE);
+    set_header_and_footer(blk, size, 0);
+    next_blk(blk)->header = 1;
+
+    /* Coalesce if the previous block was free */
+    return coalesce(blk);
+}
+
+/*
+ * coalesce - Boundary tag coalescing. Takes the free neighbours of bp off
+ *     the free lists and returns the merged block, which is on none.
+ */
+static struct block *coalesce(struct block *bp)
+{
+    bool prev_alloc = *prev_blk_footer(bp) & 1;
+    bool next_alloc = ! blk_free(next_blk(bp));
+    size_t size = blk_size(bp);
+
+    if (!next_alloc) {
+        remove_free(next_blk(bp));
+        size += blk_size(next_blk(bp));
+    }
+    if (!prev_alloc) {
+        bp = prev_blk(bp);
+        remove_free(bp);
+        size += blk_size(bp);
+    }
+    set_header_and_footer(bp, size, 0);
+    return bp;
+}
+
+/*
+ * place - Place block of asize bytes at start of free block bp, which is on
+ *         no free list, and split if remainder would be at least minimum block size
+ */
+static void place(struct block *bp, size_t asize)
+{
+    size_t csize = blk_size(bp);
+
+    if ((csize - asize) >= MIN_BLOCK_SIZE) {
+        set_header_and_footer(bp, asize, 1);
+        bp = next_blk(bp);
+        set_header_and_footer(bp, csize - asize, 0);
+        insert_free(bp);
+    }
+    else {
+        set_header_and_footer(bp, csize, 1);
+    }
+}
+
+/* Orders tree nodes by block size, then by address */
+static bool node_less(struct rb_node *a, struct rb_node *b) {
+    size_t asize = blk_size(blk_from_node(a));
+    size_t bsize = blk_size(blk_from_node(b));
+    return asize < bsize || (asize == bsize && (uintptr_t) a < (uintptr_t) b);
+}
+
+/* Makes child take the place of node under node's parent */
+static void replace_child(struct rb_node *node, struct rb_node *child) {
+    struct rb_node *parent = node->parent;
+
+    if (parent == NULL)
+        tree_root = child;
+    else if (parent->left == node)
+        parent->left = child;
+    else
+        parent->right = child;
+    if (child != NULL)
+        child->parent = parent;
+}
+
+static void rotate_left(struct rb_node *x) {
+    struct rb_node *y = x->right;
+
+    x->right = y->left;
+    if (y->left != NULL)
+        y->left->parent = x;
+    replace_child(x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+static void rotate_right(struct rb_node *x) {
+    struct rb_node *y = x->left;
+
+    x->left = y->right;
+    if (y->right != NULL)
+        y->right->parent = x;
+    replace_child(x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+static void tree_insert(struct rb_node *z) {
+    struct rb_node **link = &tree_root;
+    struct rb_node *parent = NULL;
+    struct rb_node *uncle;
+    struct rb_node *g;
+
+    while (*link != NULL) {
+        parent = *link;
+        link = node_less(z, parent) ? &parent->left : &parent->right;
+    }
+    z->left = z->right = NULL;
+    z->parent = parent;
+    z->red = true;
+    *link = z;
+
+    /* fix up red-red violations going up */
+    while ((parent = z->parent) != NULL && parent->red) {
+        g = parent->parent;
+        if (parent == g->left) {
+            uncle = g->right;
+            if (uncle != NULL && uncle->red) {
+                parent->red = uncle->red = false;
+                g->red = true;
+                z = g;
+                continue;
+            }
+            if (z == parent->right) {
+                rotate_left(parent);
+                z = parent;
+                parent = z->parent;
+            }
+            rotate_right(g);
+        } else {
+            uncle = g->left;
+            if (uncle != NULL && uncle->red) {
+                parent->red = uncle->red = false;
+                g->red = true;
+                z = g;
+                continue;
+            }
+            if (z == parent->left) {
+                rotate_right(parent);
+                z = parent;
+                parent = z->parent;
+            }
+            rotate_left(g);
+        }
+        parent->red = false;
+        g->red = true;
+    }
+    tree_root->red = false;
+}
+
+static void tree_remove(struct rb_node *z) {
+    struct rb_node *x;          /* node moving into the removed position */
+    struct rb_node *xparent;    /* its parent, as x may be NULL */
+    struct rb_node *w;
+    struct rb_node *y = z;
+    bool removed_red = z->red;
+
+    if (z->left == NULL) {
+        x = z->right;
+        xparent = z->parent;
+        replace_child(z, x);
+    } else if (z->right == NULL) {
+        x = z->left;
+        xparent = z->parent;
+        replace_child(z, x);
+    } else {
+        /* splice out z's successor y and put it in z's place */
+        for (y = z->right; y->left != NULL; y = y->left)
+            ;
+        removed_red = y->red;
+        x = y->right;
+        if (y->parent == z) {
+            xparent = y;
+        } else {
+            xparent = y->parent;
+            replace_child(y, x);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        replace_child(z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+    if (removed_red)
+        return;
+
+    /* x carries an extra black; push it up until it can be absorbed */
+    while (x != tree_root && (x == NULL || !x->red)) {
+        if (x == xparent->left) {
+            w = xparent->right;
+            if (w->red) {
+                w->red = false;
+                xparent->red = true;
+                rotate_left(xparent);
+                w = xparent->right;
+            }
+            if ((w->left == NULL || !w->left->red) && (w->right == NULL || !w->right->red)) {
+                w->red = true;
+                x = xparent;
+                xparent = x->parent;
+            } else {
+                if (w->right == NULL || !w->right->red) {
+                    w->left->red = false;
+                    w->red = true;
+                    rotate_right(w);
+                    w = xparent->right;
+                }
+                w->red = xparent->red;
+                xparent->red = false;
+                w->right->red = false;
+                rotate_left(xparent);
+                x = tree_root;
+            }
+        } else {
+            w = xparent->left;
+            if (w->red) {
+                w->red = false;
+                xparent->red = true;
+                rotate_right(xparent);
+                w = xparent->left;
+            }
+            if ((w->left == NULL || !w->left->red) && (w->right == NULL || !w->right->red)) {
+                w->red = true;
+                x = xparent;
+                xparent = x->parent;
+            } else {
+                if (w->left == NULL || !w->left->red) {
+                    w->right->red = false;
+                    w->red = true;
+                    rotate_left(w);
+                    w = xparent->left;
+                }
+                w->red = xparent->red;
+                xparent->red = false;
+                w->left->red = false;
+                rotate_right(xparent);
+                x = tree_root;
+            }
+        }
+    }
+    if (x != NULL)
+        x->red = false;
+}
+
+/* Returns the smallest block in the tree of at least asize bytes, lowest address first */
+static struct block *tree_best_fit(size_t asize) {
+    struct rb_node *node = tree_root;
+    struct rb_node *best = NULL;
+
+    while (node != NULL) {
+        if (blk_size(blk_from_node(node)) >= asize) {
+            best = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return best != NULL ? blk_from_node(best) : NULL;
+}
+
+/* Puts a free block on its list, or in the tree if it is large */
+static void insert_free(struct block *bp) {
+    size_t size = blk_size(bp);
+
+    if (size >= TREE_MIN)
+        tree_insert(&bp->node);
+    else
+        list_push_front(&free_lists[size / ALIGNMENT], &bp->elem);
+}
+
+/* Takes a free block off its list or out of the tree */
+static void remove_free(struct block *bp) {
+    if (blk_size(bp) >= TREE_MIN)
+        tree_remove(&bp->node);
+    else
+        list_remove(&bp->elem);
+}
+
+/*
+ * find_fit - Find the best fit for a block with asize bytes and take it
+ *     off the free lists
+ */
+static struct block *find_fit(size_t asize)
+{
+    struct block *bp;
+    size_t i;
+
+    /* the lists hold one size each, so the first non-empty one is the best fit */
+    for (i = asize / ALIGNMENT; i < NUM_LISTS; i++) {
+        if (!list_empty(&free_lists[i])) {
+            bp = list_entry(list_pop_front(&free_lists[i]), struct block, elem);
+            return bp;
+        }
+    }
+    bp = tree_best_fit(asize);
+    if (bp != NULL)
+        tree_remove(&bp->node);
+    return bp;
+}
+
+team_t team = {
+    /* Team name */
+    "Reference allocator using a red-black tree",
+    /* First member's full name */
+    "Allocator maintainers",
+    "maintainers",
+    /* Second member's full name (leave blank if none) */
+    "",
+    "",
+};
@@ -1,8 +1,72 @@
 /* 
  * In our approach we use a segmented list to keep track of all the free blocks.
- * We segmented based off of powers of 2. Our lists are doubly linked, using the payload to store the list_elem*
- * Our header stores the size, prev_size, and if it's free. Using the prev_size we can look at the previous node.
- * When reallocing we coalesc blocks together. Aswell as just checking free blocks for a correct size
+ * The lists form a two-level (TLSF) index: the first level splits sizes by powers of 2, the second
+ * splits each power of 2 into SL_COUNT equal ranges. One bitmap per level records which lists are
+ * non-empty, so finding a large enough block takes two find-first-set operations.
+ * Our lists are doubly linked, using the payload to store the list_elem*
+ * Our header is one word: the block size, header included, with a free bit and a prev-free bit packed
+ * into its low bits. Only free blocks repeat their size in a footer, which is all we need to find
+ * the previous block when it's free. Each region ends in an allocated EPILOGUE_SIZE block, so every
+ * block has a next block of its own arena to carry the prev-free bit.
+ * A free block larger than the request is split, and the tail goes back on the lists if it has room
+ * for a list node and a footer.
+ * Freeing a block merges it with both neighbours if they are free, so no two free blocks are ever adjacent.
+ * With DEFERRED_COALESCE set, frees skip the merge instead, and an arena sweeps its regions for runs of
+ * free blocks only when a request misses every free list, just before it would grow the heap.
+ * Realloc grows a block in place when it can: into a free next neighbour, past the brk, or down
+ * into a free previous neighbour (and the next one too), moving the payload with memmove.
+ *
+ * In front of the free lists every thread keeps a small cache of recently freed blocks, one
+ * bounded stack per size class. Cached blocks stay marked as allocated, so the heap never sees
+ * them. mm_malloc/mm_free only take the heap lock when a stack runs empty or full, and then move
+ * a whole batch of blocks at once.
+ *
+ * The heap is split between NUM_ARENAS arenas, each with its own lock, free lists and last_header.
+ * Threads are handed arenas round-robin. An arena grows at the top of its newest region; once
+ * another arena has grown past it, it carves what it can from the wilderness it left behind, and
+ * then starts a new region, on a page of its own so that arena_map can tell which arena owns any
+ * payload. Blocks are always freed back to the arena that owns them.
+ *
+ * The heap grows just far enough to end on an ARENA_PAGE boundary, so the next region needs no
+ * padding. Whatever a growth doesn't hand out stays at the top of the arena as its wilderness: a
+ * free last block that the free lists leave out, so requests they can't serve are carved off its
+ * front, and frees at the top merge back into it.
+ *
+ * Requests up to SLAB_MAX bytes are served from slabs: ARENA_PAGE sized blocks dedicated to one
+ * size class. Objects in a slab have no header; the slab keeps one free bit per object at the
+ * start of the page, and arena_map flags slab pages so mm_free can find the slab from a pointer.
+ * An arena keeps up to SLAB_POOL empty slab pages for any class, and frees the rest as heap
+ * blocks, so slabs don't pin the top of the heap or keep free blocks apart.
+ * Each slab class of each arena has a lock of its own, so small requests of different classes
+ * don't wait on each other. Every other request of an arena, whatever its size, takes the one
+ * arena lock; the heap bins have no locks of their own. Locks are taken class first, then arena,
+ * then brk_lock.
+ *
+ * A thread owns the blocks of the arena it allocates from. Blocks it frees that belong to another
+ * arena take no lock: they are pushed onto a lock-free queue next to the lock they belong under,
+ * and whoever next allocates under that lock frees the whole queue in one go. A pipeline where one
+ * thread allocates and another frees thus never has the freeing thread touch the owner's lists.
+ *
+ * Requests of MMAP_THRESHOLD bytes or more bypass the arenas and get a mapping of their own from
+ * mem_map, with BLOCK_MAPPED set in the header. Freeing one unmaps it, so large transient buffers
+ * never raise the heap's high-water mark. Reallocating one to another large size goes through
+ * mem_remap, which moves the pages rather than copying the bytes.
+ *
+ * When a free block of TRIM_THRESHOLD bytes or more ends up last in the arena that owns the brk,
+ * the heap is shrunk back down to one HEAP_CHUNK of wilderness. mm_trim does the same on request.
+ *
+ * Free blocks of PURGE_MIN bytes or more stamp the time they went on the lists. Once one has sat
+ * there for PURGE_DECAY_MS, the next heap_free of its arena hands the whole pages inside it back
+ * with mem_purge, keeping the list node and footer pages. Each arena counts the large blocks still
+ * waiting, so frees only look at the clock while something is waiting. mdriver reports what stays
+ * resident through memlib.
+ *
+ * mm_memalign over-allocates from the heap and frees the slack on both sides of the aligned block.
+ * Large requests or alignments get a mapping placed so the payload lands on the boundary.
+ *
+ * mm_calloc only clears what isn't known to be zero already. heap_fresh marks the lowest address
+ * mem_sbrk has never handed out, each arena knows how much of its wilderness was never written,
+ * and a purged free block knows its interior pages read as zeros.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,44 +75,247 @@
 #include <string.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
 
 #include "mm.h"
 #include "list.h"
 #include "memlib.h"
 #include "config.h"             /* defines ALIGNMENT */
 
-#define NUM_BUCKETS 6
+/* Free index parameters */
+#define SL_LOG2     3                           /* second level splits a power of 2 in 8 */
+#define SL_COUNT    (1 << SL_LOG2)
+#define SMALL_BLOCK (SL_COUNT * ALIGNMENT)      /* sizes below this are all in first level 0 */
+#define FL_SHIFT    (SL_LOG2 + __builtin_ctz(ALIGNMENT))  /* log2(SMALL_BLOCK) */
+#define FL_COUNT    (sizeof(size_t) * 8 - FL_SHIFT + 1)   /* enough for any size_t */
 
+/* Block layout */
+#define BLOCK_FREE    1                         /* header flag: the block is free */
+#define PREV_FREE     2                         /* header flag: the block before is free and has a footer */
+#define BLOCK_MAPPED  4                         /* header flag: the block is a mapping of its own */
+#define FLAG_MASK     (BLOCK_FREE | PREV_FREE | BLOCK_MAPPED)
+#define MIN_BLOCK     ((sizeof(struct block_header) + sizeof(struct list_elem) + sizeof(size_t) \
+                        + ALIGNMENT - 1) & ~(ALIGNMENT - 1)) /* header, list node and footer */
+#define EPILOGUE_SIZE ALIGNMENT                 /* smaller than any real block */
+
+/* Arena parameters */
+#define NUM_ARENAS 4
+#define CACHE_LINE 64                           /* locks taken by different threads sit this far apart */
+#define ARENA_PAGE 4096                         /* granularity of arena_map */
+#define MAP_SLAB   0x80                         /* arena_map flag for slab pages */
+
+/* Slab parameters */
+#define USE_SLABS    1
+#define SLAB_MAX     64                         /* largest request served from a slab */
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)     /* one class per ALIGNMENT step */
+#define SLAB_WORDS   (ARENA_PAGE / ALIGNMENT / 32) /* free bitmap words per slab */
+#define SLAB_POOL    4                          /* empty slab pages an arena keeps for reuse */
+
+/* Direct mapping parameters */
+#define MMAP_THRESHOLD (128 * 1024)             /* smallest request given its own mapping */
+
+/* Trimming parameters */
+#define TRIM_THRESHOLD (128 * 1024)             /* smallest free top block given back on free */
+#define HEAP_CHUNK     (8 * 1024)               /* wilderness kept when the heap shrinks */
+
+/* Purging parameters */
+#define PURGE_DECAY_MS 10                       /* how long a large free block stays resident */
+#define PURGE_MIN      (2 * ARENA_PAGE + MIN_BLOCK) /* smallest free block whose pages get purged */
+
+/* Coalescing parameters */
+#define DEFERRED_COALESCE   0                   /* merge on a failed fit instead of on free */
+#define COALESCE_THRESHOLD  16                  /* frees needed since the last sweep to sweep again */
+
+/* Realloc parameters */
+#define GROW_RESERVE(size) ((size) / 2)         /* slack added when a block grows again */
+
+/* Thread cache parameters */
+#define TCACHE_MAX     512                      /* largest payload kept in a thread cache */
+#define TCACHE_CLASSES (TCACHE_MAX / ALIGNMENT) /* one stack per ALIGNMENT step */
+#define TCACHE_COUNT   16                       /* max blocks per stack */
+#define TCACHE_BATCH   8                        /* blocks moved per refill/flush */
+
+/* Headers sit one word below an ALIGNMENT boundary, so payloads are aligned */
 struct block_header {
-    /* Size of previous payload */
-    size_t prev_size;
-    /* Size of payload */
+    /* Size of the block, header included, or'ed with BLOCK_FREE and PREV_FREE */
     size_t size;
-    unsigned char free : 1;
-    char        payload[0] __attribute__((aligned(ALIGNMENT)));
+    char   payload[0];
+};
+
+/* Lives at the start of a slab page, followed by the objects */
+struct slab {
+    struct list_elem elem;          /* in the arena's list for this class while not full */
+    unsigned short size;            /* object size */
+    unsigned short nobjs;
+    unsigned short nfree;
+    uint32_t free_bits[SLAB_WORDS]; /* bit set = object free */
+    char objs[0] __attribute__((aligned(ALIGNMENT)));
 };
 
-struct list free_lists[NUM_BUCKETS];
-static struct block_header* last_header;
+/* Blocks freed by threads allocating from other arenas, waiting to be freed under the lock they
+ * belong to. A stack linked through the first word of their payload: any thread pushes with a
+ * compare and swap, and a holder of the lock takes the whole stack at once. It has a cache line to
+ * itself, so pushes don't bounce the lock or the lists. */
+struct remote_queue {
+    void* head;
+} __attribute__((aligned(CACHE_LINE)));
+
+/* The slabs of one size class of an arena. Each class has a lock of its own, so small requests
+ * of different sizes don't wait on each other. They take the arena lock only to get or give back
+ * a page. */
+struct slab_class {
+    /* Protects the list and every slab on it, or holding objects of this class */
+    pthread_mutex_t lock;
+    /* Slabs with at least one free object */
+    struct list slabs;
+    /* Objects of this class freed by other arenas' threads */
+    struct remote_queue remote;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct arena {
+    /* Protects everything below but the slab classes, and all blocks owned by the arena */
+    pthread_mutex_t lock;
+    struct list free_lists[FL_COUNT][SL_COUNT];
+    /* Bit fl set if any list in free_lists[fl] is non-empty */
+    size_t fl_bitmap;
+    /* Bit sl of sl_bitmap[fl] set if free_lists[fl][sl] is non-empty */
+    unsigned sl_bitmap[FL_COUNT];
+    struct slab_class classes[SLAB_CLASSES];
+    /* Empty slab pages, ready to be given any class */
+    struct list free_slabs;
+    unsigned free_slab_count;
+    /* Last block of the arena's newest region. When free, it is the wilderness: the free lists
+     * leave it out, and it is carved only when they have nothing that fits. */
+    struct block_header* last_header;
+    /* Bytes of the wilderness from here up read as zeros, its footer aside */
+    char* fresh;
+    /* Newest region of the arena */
+    struct region* regions;
+    /* Frees that skipped coalescing since the last sweep */
+    unsigned deferred_frees;
+    /* Free blocks of PURGE_MIN bytes or more whose pages are still resident */
+    unsigned purge_pending;
+    /* purge_clock() at the last purge sweep */
+    unsigned last_purge;
+    /* Heap blocks freed by other arenas' threads */
+    struct remote_queue remote;
+} __attribute__((aligned(CACHE_LINE)));
+
+/* Follows the list node of every free block of PURGE_MIN bytes or more */
+struct purge_info {
+    unsigned freed_at;      /* purge_clock() when the block went on the free lists */
+    bool purged;            /* its whole pages have been handed back */
+};
+
+/* A run of bytes known to read as zeros */
+struct zero_run {
+    char* lo;
+    char* hi;
+};
+
+/* Kept in the payload of the fence block opening each region */
+struct region {
+    struct region* prev;    /* the arena's previous region */
+};
+
+static struct arena arenas[NUM_ARENAS];
+/* Owning arena of each ARENA_PAGE of the heap, indexed by payload address */
+static unsigned char arena_map[MAX_HEAP / ARENA_PAGE];
+/* Entries of arena_map written since mm_init, so a large map is only touched as far as it's used */
+static size_t arena_map_pages;
+static char* heap_base;
+/* Lowest address mem_sbrk has never handed out, so it and everything above reads as zeros */
+static char* heap_fresh;
+/* Serializes calls into memlib. Never held while taking an arena lock. */
+static pthread_mutex_t brk_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Round-robin counter for handing out arenas to threads */
+static unsigned next_arena;
+static __thread struct arena* thread_arena;
+/* Bumped by mm_init so that caches filled from an older heap get dropped */
+static unsigned heap_epoch;
+
+/* A stack of cached blocks, linked through the first word of their payload */
+struct tcache_bin {
+    void* head;
+    unsigned count;
+};
+
+struct tcache {
+    unsigned epoch;
+    struct tcache_bin bins[TCACHE_CLASSES];
+    /* Block this thread last grew with mm_realloc, and the size it asked for */
+    void* grow_ptr;
+    size_t grow_size;
+    /* tcache_key has been set, so the cache is emptied when the thread exits */
+    bool armed;
+};
+
+static __thread struct tcache tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
 
 /* Declarations of functions */
-int get_free_list(size_t size);
+static void insert_free_block(struct arena* a, struct block_header* header);
+static void remove_free_block(struct arena* a, struct block_header* header);
+static void split_block(struct arena* a, struct block_header* header, size_t size);
+static bool arena_new_region(struct arena* a);
+static void remote_drain(struct arena* a, struct remote_queue* q);
+static void tcache_key_init(void);
+#ifdef DEBUG
+static void check_realloc_limits(void);
+#endif
 
 
 /* Some useful macros */
  
-/* return's the previous block header */
+/* returns the size of the block, header included. Owners read it without the arena lock
+ * while a neighbour may be flipping PREV_FREE, so this load and set_prev_free are atomic. */
+static size_t block_size(struct block_header* header) {
+    return __atomic_load_n(&header->size, __ATOMIC_RELAXED) & ~(size_t) FLAG_MASK;
+}
+static bool block_free(struct block_header* header) {
+    return header->size & BLOCK_FREE;
+}
+static bool prev_free(struct block_header* header) {
+    return header->size & PREV_FREE;
+}
+/* return's the previous block header, only valid if it is free */
 static struct block_header* prev_block(struct block_header* header) {
-    return (struct block_header*) ((void*) header - header->prev_size - sizeof(struct block_header));
+    return (struct block_header*) ((void*) header - ((size_t*) header)[-1]);
 }
 /* returns the next block header */
 static struct block_header* next_block(struct block_header* header) {
-    return (struct block_header*) (header->payload + header->size);
+    return (struct block_header*) ((void*) header + block_size(header));
 }
 /* gets a header from the payload */
 static struct block_header* header_from_node(struct list_elem* node) {
     return (struct block_header*) ((void*) node - sizeof(struct block_header));
 }
+/* Sets or clears PREV_FREE of a block. Writers hold the arena lock, so a plain
+ * read-modify-write made of relaxed atomics is enough. */
+static void set_prev_free(struct block_header* header, bool free) {
+    size_t size = __atomic_load_n(&header->size, __ATOMIC_RELAXED);
+    size = free ? size | PREV_FREE : size & ~(size_t) PREV_FREE;
+    __atomic_store_n(&header->size, size, __ATOMIC_RELAXED);
+}
+/* Marks a block free with the given size, writing its footer and telling the next block */
+static void set_free(struct block_header* header, size_t size) {
+    header->size = size | BLOCK_FREE | (header->size & PREV_FREE);
+    *(size_t*) ((void*) header + size - sizeof(size_t)) = size;
+    set_prev_free(next_block(header), true);
+}
+/* Marks a block allocated with the given size, and tells the next block */
+static void set_used(struct block_header* header, size_t size) {
+    header->size = size | (header->size & PREV_FREE);
+    set_prev_free(next_block(header), false);
+}
+/* Writes the epilogue closing a region at header */
+static void set_epilogue(struct block_header* header, bool after_free) {
+    header->size = EPILOGUE_SIZE | (after_free ? PREV_FREE : 0);
+}
 
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
@@ -80,6 +347,13 @@ static size_t roundup(size_t size)
     return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
 }
 
+/* Returns the size of the block, header included, that serves a request of size bytes */
+static size_t adjust_size(size_t size)
+{
+    size = roundup(size + sizeof(struct block_header));
+    return size < MIN_BLOCK ? MIN_BLOCK : size;
+}
+
 /* 
  * mm_init - initialize the malloc package.
  */
@@ -87,174 +361,1577 @@ int mm_init(void)
 {
     /* Sanity checks. */
     assert((ALIGNMENT & (ALIGNMENT - 1)) == 0); // power of 2
-    assert(sizeof(struct block_header) % ALIGNMENT == 0);
-    assert(offsetof(struct block_header, payload) % ALIGNMENT == 0);
+    assert(sizeof(struct block_header) == sizeof(size_t));
+    assert(sizeof(struct block_header) <= ALIGNMENT);
     assert(offsetof(struct block_header, payload) == sizeof(struct block_header));
-    struct block_header* blk = mem_sbrk(sizeof(struct block_header));
-    int i;
+    assert(MIN_BLOCK > EPILOGUE_SIZE);
+    assert(FLAG_MASK < ALIGNMENT);
+    assert(MMAP_THRESHOLD > TCACHE_MAX && MMAP_THRESHOLD > SLAB_MAX);
+    int i, j, k;
 
-    for (i = 0; i < NUM_BUCKETS; i++)
-        list_init(&free_lists[i]);
+    heap_base = mem_heap_lo();
+    heap_fresh = mem_heap_fresh();
+    memset(arena_map, 0, arena_map_pages);
+    arena_map_pages = 0;
+    for (i = 0; i < NUM_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        for (j = 0; j < FL_COUNT; j++)
+            for (k = 0; k < SL_COUNT; k++)
+                list_init(&arenas[i].free_lists[j][k]);
+        memset(arenas[i].sl_bitmap, 0, sizeof(arenas[i].sl_bitmap));
+        arenas[i].fl_bitmap = 0;
+        for (j = 0; j < SLAB_CLASSES; j++) {
+            pthread_mutex_init(&arenas[i].classes[j].lock, NULL);
+            list_init(&arenas[i].classes[j].slabs);
+            arenas[i].classes[j].remote.head = NULL;
+        }
+        list_init(&arenas[i].free_slabs);
+        arenas[i].free_slab_count = 0;
+        arenas[i].last_header = NULL;
+        arenas[i].fresh = NULL;
+        arenas[i].regions = NULL;
+        arenas[i].deferred_frees = 0;
+        arenas[i].purge_pending = 0;
+        arenas[i].last_purge = 0;
+        arenas[i].remote.head = NULL;
+    }
+    heap_epoch++;
 
-    last_header = blk;
-    blk->prev_size = 0;
-    blk->size = 0;
-    blk->free = false;
+    /* the first arena starts at the bottom of the heap */
+    if (!arena_new_region(&arenas[0]))
+        return -1;
+#ifdef DEBUG
+    check_realloc_limits();
+#endif
     return 0;
 }
+
+/* Returns the arena the calling thread allocates from */
+static struct arena* arena_get(void) {
+    if (thread_arena == NULL)
+        thread_arena = &arenas[__sync_fetch_and_add(&next_arena, 1) % NUM_ARENAS];
+    return thread_arena;
+}
+
+/* Returns true if ptr is the payload of a block with a mapping of its own */
+static bool is_mapped(void* ptr) {
+    return (char*) ptr < heap_base || (char*) ptr >= heap_base + MAX_HEAP;
+}
+
+/* Returns the arena owning the block with the given payload */
+static struct arena* arena_of(void* ptr) {
+    return &arenas[arena_map[((char*) ptr - heap_base) / ARENA_PAGE] & ~MAP_SLAB];
+}
+
+/* Returns the slab holding ptr, or NULL if ptr is the payload of an ordinary block */
+static struct slab* slab_of(void* ptr) {
+    size_t page = ((char*) ptr - heap_base) / ARENA_PAGE;
+    if (!(arena_map[page] & MAP_SLAB))
+        return NULL;
+    return (struct slab*) (heap_base + page * ARENA_PAGE);
+}
+
+/* Records a as the owner of all pages holding payload bytes in [lo, hi). Caller must hold
+ * brk_lock. */
+static void arena_map_set(struct arena* a, char* lo, char* hi) {
+    size_t page;
+    /* pages we already own may be read concurrently, so only fresh ones are written */
+    for (page = (lo - heap_base) / ARENA_PAGE; page <= (hi - 1 - heap_base) / ARENA_PAGE; page++)
+        if ((arena_map[page] & ~MAP_SLAB) != a - arenas)
+            arena_map[page] = a - arenas;
+    if (page > arena_map_pages)
+        arena_map_pages = page;
+}
+
+/* Calls mem_sbrk, moving heap_fresh past any memory it hands out. Caller must hold brk_lock,
+ * or be mm_init. */
+static void* heap_sbrk(intptr_t incr) {
+    void* p = mem_sbrk(incr);
+
+    if (p != NULL && (char*) mem_heap_hi() + 1 > heap_fresh)
+        heap_fresh = (char*) mem_heap_hi() + 1;
+    return p;
+}
+
+/* Returns true if the newest region of a ends at the brk. Caller must hold brk_lock. */
+static bool arena_at_top(struct arena* a) {
+    return a->last_header != NULL
+        && (void*) next_block(a->last_header) + EPILOGUE_SIZE == mem_heap_hi() + 1;
+}
+
+/* Returns the size of the wilderness of a, or 0 if its last block is in use */
+static size_t wild_size(struct arena* a) {
+    return a->last_header != NULL && block_free(a->last_header) ? block_size(a->last_header) : 0;
+}
+
+/* Returns how far into the free space starting at wild a block must start for its payload to
+ * land on an ARENA_PAGE, leaving room for a free block in front if it isn't already there */
+static size_t page_gap(struct block_header* wild) {
+    size_t off = (char*) wild->payload - heap_base;
+    size_t gap = ((off + ARENA_PAGE - 1) & ~(size_t) (ARENA_PAGE - 1)) - off;
+
+    if (gap > 0 && gap < MIN_BLOCK)
+        gap += ARENA_PAGE;
+    return gap;
+}
+
+/* Starts a new region for a at the brk. The region opens with an allocated fence block
+ * holding the struct region, followed by the epilogue. If the brk is mid-page, the first
+ * block's payload goes on the next ARENA_PAGE, which no payload of the region below shares.
+ * Caller must hold brk_lock, or be mm_init. */
+static bool arena_new_region(struct arena* a) {
+    size_t off = mem_heapsize();
+    size_t start = off;
+    size_t page = (off + ARENA_PAGE - 1) & ~(size_t) (ARENA_PAGE - 1);
+    size_t first_payload;
+    struct block_header* fence;
+    struct block_header* old = a->last_header;
+    struct region* r;
+
+    /* only an empty heap may share the first page, it needs a pad to align the first header */
+    if (off == 0)
+        start = ALIGNMENT - sizeof(struct block_header);
+    first_payload = roundup(start + 2 * sizeof(struct block_header) + sizeof(struct region));
+    if (first_payload < page)
+        first_payload = page;
+    fence = heap_sbrk(first_payload - sizeof(struct block_header) + EPILOGUE_SIZE - off);
+    if (fence == NULL)
+        return false;
+    fence = (struct block_header*) ((char*) fence + start - off);
+    fence->size = first_payload - sizeof(struct block_header) - start;
+    set_epilogue(next_block(fence), false);
+
+    r = (struct region*) fence->payload;
+    r->prev = a->regions;
+    a->regions = r;
+    a->last_header = fence;
+    /* the old wilderness stays behind as an ordinary free block */
+    if (old != NULL && block_free(old))
+        insert_free_block(a, old);
+    return true;
+}
+
+/* Makes the last block of a a free block of at least size bytes, and returns it. The heap
+ * grows up to the next ARENA_PAGE boundary past size, so that whichever region comes next
+ * starts on a page of its own, or by just enough if that fails. Caller must hold a->lock and
+ * brk_lock, and a must end at the brk unless its wilderness already holds size bytes. */
+static struct block_header* wild_grow(struct arena* a, size_t size) {
+    struct block_header* wild = a->last_header;
+    char* brk = (char*) mem_heap_hi() + 1;
+    char* fresh = heap_fresh;
+    size_t have = 0;
+    size_t incr;
+
+    if (block_free(wild))
+        have = block_size(wild);
+    else
+        wild = next_block(wild);    /* the epilogue */
+    if (have >= size)
+        return wild;
+    if (size < MIN_BLOCK)
+        size = MIN_BLOCK;
+    if (size - have > PTRDIFF_MAX - ARENA_PAGE)
+        return NULL;
+    incr = (((size_t) (brk - heap_base) + size - have + ARENA_PAGE - 1) & ~(size_t) (ARENA_PAGE - 1))
+        - (size_t) (brk - heap_base);
+    if (heap_sbrk(incr) == NULL && heap_sbrk(incr = size - have) == NULL)
+        return NULL;
+
+    /* the old footer and epilogue end up inside the wilderness, clear them */
+    if (have > 0)
+        memset((char*) wild + have - sizeof(size_t), 0, sizeof(size_t) + sizeof(struct block_header));
+    set_free(wild, have + incr);
+    set_epilogue(next_block(wild), true);
+    a->last_header = wild;
+    arena_map_set(a, wild->payload, (char*) next_block(wild));
+    /* memory below the high-water mark was handed out before */
+    if ((have == 0 || fresh > brk) && a->fresh < fresh)
+        a->fresh = fresh;
+    return wild;
+}
+
+/* Notes that header, which may have been carved from the wilderness of a, now holds whatever
+ * its owner writes. Caller must hold a->lock. */
+static void wild_carved(struct arena* a, struct block_header* header) {
+    char* end = next_block(header)->payload;
+
+    if (a->fresh < end)
+        a->fresh = end;
+}
+
+/* Carves a block of newsize bytes (header included) off the front of the wilderness of a,
+ * growing the heap or starting a new region first if needed. A wilderness left behind by
+ * another arena's growth is used up before a new region is started. If zero isn't NULL, it
+ * gets the part of the payload known to read as zeros. Caller must hold a->lock. */
+static struct block_header* arena_grow(struct arena* a, size_t newsize, struct zero_run* zero) {
+    struct block_header* blk = NULL;
+
+    pthread_mutex_lock(&brk_lock);
+    if (!arena_at_top(a) && wild_size(a) < newsize && !arena_new_region(a))
+        goto out;
+    if ((blk = wild_grow(a, newsize)) == NULL)
+        goto out;
+
+    set_used(blk, block_size(blk));
+    split_block(a, blk, newsize);
+    if (zero != NULL) {
+        zero->lo = a->fresh > blk->payload ? a->fresh : blk->payload;
+        zero->hi = (char*) next_block(blk) - sizeof(size_t);
+    }
+    wild_carved(a, blk);
+out:
+    pthread_mutex_unlock(&brk_lock);
+    return blk;
+}
+
+/* Carves an ARENA_PAGE sized block whose payload starts on a page boundary out of the
+ * wilderness of a, growing it first if needed. The part of the wilderness below the page
+ * becomes an ordinary free block. Caller must hold a->lock. */
+static struct block_header* arena_grow_page(struct arena* a) {
+    struct block_header* blk = NULL;
+    struct block_header* wild;
+    struct block_header* tail;
+    size_t gap, rest;
+
+    pthread_mutex_lock(&brk_lock);
+    if (!arena_at_top(a) && (wild_size(a) == 0
+                || wild_size(a) < page_gap(a->last_header) + ARENA_PAGE + MIN_BLOCK)
+            && !arena_new_region(a))
+        goto out;
+
+    /* the wilderness starts at the last block if it is free, else at the epilogue */
+    wild = block_free(a->last_header) ? a->last_header : next_block(a->last_header);
+    gap = page_gap(wild);
+    if ((wild = wild_grow(a, gap + ARENA_PAGE + MIN_BLOCK)) == NULL)
+        goto out;
+
+    blk = (struct block_header*) ((char*) wild + gap);
+    tail = (struct block_header*) ((char*) blk + ARENA_PAGE);
+    rest = block_size(wild) - gap - ARENA_PAGE;
+    tail->size = 0;
+    set_free(tail, rest);
+    blk->size = gap > 0 ? 0 : wild->size & PREV_FREE;
+    set_used(blk, ARENA_PAGE);
+    a->last_header = tail;
+    if (gap > 0) {
+        set_free(wild, gap);
+        insert_free_block(a, wild);
+    }
+    wild_carved(a, blk);
+out:
+    pthread_mutex_unlock(&brk_lock);
+    return blk;
+}
+
+/* Gives all but pad bytes of the free last block of a back to the system, if a ends at the brk.
+ * Returns true if it did. Caller must hold a->lock. */
+static bool arena_trim(struct arena* a, size_t pad) {
+    struct block_header* last = a->last_header;
+    size_t keep = adjust_size(pad);
+    size_t size;
+    bool trimmed = false;
+
+    pthread_mutex_lock(&brk_lock);
+    size = block_size(last);
+    if (block_free(last) && size >= keep + mem_pagesize() && arena_at_top(a)
+            && mem_sbrk(-(intptr_t) (size - keep)) != NULL) {
+        remove_free_block(a, last);
+        set_epilogue((struct block_header*) ((void*) last + keep), true);
+        set_free(last, keep);
+        insert_free_block(a, last);
+        trimmed = true;
+    }
+    pthread_mutex_unlock(&brk_lock);
+    return trimmed;
+}
+
+/* Gives the newest region of a back to the system if it ends at the brk and holds nothing but
+ * its wilderness. The last block of the region below then becomes the wilderness. The region
+ * at the bottom of the heap is always kept. Caller must hold a->lock and brk_lock. */
+static bool arena_drop_region(struct arena* a) {
+    struct region* r = a->regions;
+    struct block_header* fence;
+    struct block_header* last;
+    struct block_header* b;
+
+    if (r == NULL || !arena_at_top(a))
+        return false;
+    fence = header_from_node((struct list_elem*) r);
+    if ((char*) fence < heap_base + ALIGNMENT)
+        return false;
+    if (a->last_header != fence
+            && (a->last_header != next_block(fence) || !block_free(a->last_header)))
+        return false;
+    /* the fence goes back to the system with the rest */
+    r = r->prev;
+    if (mem_sbrk(-(intptr_t) ((char*) mem_heap_hi() + 1 - (char*) fence)) == NULL)
+        return false;
+
+    a->regions = r;
+    a->last_header = NULL;
+    if (r != NULL) {
+        last = header_from_node((struct list_elem*) r);
+        for (b = last; block_size(b) != EPILOGUE_SIZE; b = next_block(b))
+            last = b;
+        if (block_free(last))
+            remove_free_block(a, last);
+        a->last_header = last;
+    }
+    /* nothing is known about what the new wilderness holds */
+    a->fresh = heap_fresh;
+    return true;
+}
+
+/* Makes the wilderness of a hold at least incr bytes, if a still ends at the brk. Caller must
+ * hold a->lock. */
+static bool arena_extend(struct arena* a, size_t incr) {
+    bool grown;
+
+    pthread_mutex_lock(&brk_lock);
+    grown = arena_at_top(a) && wild_grow(a, incr) != NULL;
+    pthread_mutex_unlock(&brk_lock);
+    return grown;
+}
+
+/* Returns the index of the most significant bit set in size */
+static int msb(size_t size) {
+    return sizeof(size_t) * 8 - 1 - __builtin_clzl(size);
+}
+
+/* Returns the step between the list sizes around size: ALIGNMENT below SMALL_BLOCK, where
+ * first level 0 is split linearly, and an SL_COUNT-th of the power of 2 above it */
+static int class_shift(size_t size) {
+    return msb(size | SMALL_BLOCK) - SL_LOG2;
+}
+
+/* Returns the index of the list a free block of size bytes belongs on. Sizes below SMALL_BLOCK
+ * get the shift of first level 0, which counts them in ALIGNMENT steps, so the lists read as
+ * one run of classes fl * SL_COUNT + sl and no size needs a branch. */
+static void mapping_insert(size_t size, int* fl, int* sl) {
+    int t = class_shift(size);
+    size_t cls = ((size_t) (t + SL_LOG2 - FL_SHIFT) << SL_LOG2) + (size >> t);
+
+    *fl = cls >> SL_LOG2;
+    *sl = cls & (SL_COUNT - 1);
+}
+
+/* Returns the index of the first list whose blocks are all at least size bytes */
+static void mapping_search(size_t size, int* fl, int* sl) {
+    mapping_insert(size + ((size_t) 1 << class_shift(size)) - 1, fl, sl);
+}
+
+/* Returns a coarse monotonic clock, in milliseconds. It wraps, and is only ever compared by
+ * unsigned differences, so the product is taken unsigned: a 32-bit time_t would overflow. */
+static unsigned purge_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned) ts.tv_sec * 1000u + (unsigned) (ts.tv_nsec / 1000000);
+}
+
+/* Returns the purge bookkeeping of a free block of PURGE_MIN bytes or more */
+static struct purge_info* purge_info(struct block_header* header) {
+    return (struct purge_info*) (header->payload + sizeof(struct list_elem));
+}
+
+/* Returns the whole pages of a large free block that purging may hand back in lo and the
+ * return value, sparing its list node, purge_info and footer */
+static size_t purge_range(struct block_header* header, char** lo) {
+    size_t pagesize = mem_pagesize();
+    size_t start = (size_t) (purge_info(header) + 1);
+    size_t end = (size_t) header + block_size(header) - sizeof(size_t);
+
+    start = (start + pagesize - 1) & ~(pagesize - 1);
+    end &= ~(pagesize - 1);
+    *lo = (char*) start;
+    return end > start ? end - start : 0;
+}
+
+static void insert_free_block(struct arena* a, struct block_header* header) {
+    size_t size = block_size(header);
+    int fl, sl;
+
+    if (header == a->last_header)
+        return;     /* the wilderness */
+    mapping_insert(size, &fl, &sl);
+    list_push_front(&a->free_lists[fl][sl], (struct list_elem*) header->payload);
+    a->fl_bitmap |= (size_t) 1 << fl;
+    a->sl_bitmap[fl] |= 1u << sl;
+    if (size >= PURGE_MIN) {
+        purge_info(header)->freed_at = purge_clock();
+        purge_info(header)->purged = false;
+        a->purge_pending++;
+    }
+}
+
+static void remove_free_block(struct arena* a, struct block_header* header) {
+    size_t size = block_size(header);
+    int fl, sl;
+
+    if (header == a->last_header)
+        return;     /* the wilderness */
+    if (size >= PURGE_MIN && !purge_info(header)->purged)
+        a->purge_pending--;
+    mapping_insert(size, &fl, &sl);
+    list_remove((struct list_elem*) header->payload);
+    if (list_empty(&a->free_lists[fl][sl])) {
+        a->sl_bitmap[fl] &= ~(1u << sl);
+        if (a->sl_bitmap[fl] == 0)
+            a->fl_bitmap &= ~((size_t) 1 << fl);
+    }
+}
+
+/* Returns a free block of at least size bytes, header included, or NULL. Looks at no list nodes but the one returned. */
+static struct block_header* find_free_block(struct arena* a, size_t size) {
+    unsigned sl_map;
+    size_t fl_map;
+    int fl, sl;
+
+    mapping_search(size, &fl, &sl);
+    if (fl >= FL_COUNT)
+        return NULL;
+    sl_map = a->sl_bitmap[fl] & (~0u << sl);
+    if (sl_map == 0) {
+        /* nothing left on this level, take the smallest non-empty larger one */
+        fl_map = a->fl_bitmap & (~(size_t) 0 << (fl + 1));
+        if (fl_map == 0)
+            return NULL;
+        fl = __builtin_ctzl(fl_map);
+        sl_map = a->sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    return header_from_node(list_front(&a->free_lists[fl][sl]));
+}
+
+/* Shrinks the block header to size bytes if the rest can stand as a free block of its own,
+ * and puts the rest in the free index. Blocks smaller than that are left alone. size must be
+ * a multiple of ALIGNMENT. Caller must hold a->lock. */
+static void split_block(struct arena* a, struct block_header* header, size_t size) {
+    struct block_header* tail;
+    size_t rest;
+
+    if (block_size(header) < size + MIN_BLOCK)
+        return;
+    rest = block_size(header) - size;
+    set_used(header, size);
+    tail = next_block(header);
+    tail->size = 0;
+    set_free(tail, rest);
+    if (header == a->last_header)
+        a->last_header = tail;
+    insert_free_block(a, tail);
+}
+
 /* Checks freelists for an appropriate malloc
-    returns a payload if there is an exact match on one of the free lists, else null */
-static void* malloc_freelist(size_t size) {
-    struct list* l = &free_lists[get_free_list(size)];
-    struct list_elem* cur = &l->head;
+    returns a payload if a large enough block is on the free lists, else null.
+    If zero isn't NULL, it gets the pages of the block that were purged while it was free */
+static void* malloc_freelist(struct arena* a, size_t size, struct zero_run* zero) {
     struct block_header* cur_header;
-    struct block_header* next_header;
-    int new_size;
-    //increment one down the list, since there is always a dummy node
-    cur = list_next(cur);
-
-    struct list_elem* tail = list_end(l);
-    int count = 0;
-    while (count < 10 && cur != tail && header_from_node(cur)->size < size) {
-        cur_header = header_from_node(cur);
-        if (cur_header != last_header) {
-            next_header = next_block(cur_header);
-            new_size = next_header->size + cur_header->size + sizeof(struct block_header);
-            if (next_header->free && new_size >= size) {
-                cur_header->size = new_size;
-                cur_header->free = false;
-                if (next_header != last_header) {
-                    next_header->prev_size = new_size;
-                }
-                else
-                    last_header = cur_header;
-                list_remove((struct list_elem*) next_header->payload);
-                list_remove((struct list_elem*) cur_header->payload);
-                return cur;
+    size_t len;
+
+    size = adjust_size(size);
+    cur_header = find_free_block(a, size);
+    if (cur_header == NULL)
+        return NULL;
+    if (zero != NULL && block_size(cur_header) >= PURGE_MIN && purge_info(cur_header)->purged) {
+        len = purge_range(cur_header, &zero->lo);
+        zero->hi = zero->lo + len;
+    }
+    remove_free_block(a, cur_header);
+    set_used(cur_header, block_size(cur_header));
+    split_block(a, cur_header, size);
+    return cur_header->payload;
+}
+
+/* Merges every run of free blocks in the regions of a and rebuilds its free index
+ * from scratch. Caller must hold a->lock. */
+static void arena_coalesce(struct arena* a) {
+    struct block_header* b;
+    struct block_header* next;
+    struct region* r;
+    size_t size;
+    int fl, sl;
+
+    for (fl = 0; fl < FL_COUNT; fl++)
+        for (sl = 0; sl < SL_COUNT; sl++)
+            list_init(&a->free_lists[fl][sl]);
+    memset(a->sl_bitmap, 0, sizeof(a->sl_bitmap));
+    a->fl_bitmap = 0;
+    /* every block is stamped afresh as it goes back on the lists */
+    a->purge_pending = 0;
+
+    for (r = a->regions; r != NULL; r = r->prev) {
+        b = next_block(header_from_node((struct list_elem*) r));
+        for (; block_size(b) != EPILOGUE_SIZE; b = next_block(b)) {
+            if (!block_free(b))
+                continue;
+            size = block_size(b);
+            while (block_free(next = (struct block_header*) ((void*) b + size))) {
+                size += block_size(next);
+                if (next == a->last_header)
+                    a->last_header = b;
             }
+            set_free(b, size);
+            insert_free_block(a, b);
+        }
+    }
+    a->deferred_frees = 0;
+}
+
+/* Hands back the pages of every free block of a that has been waiting age ms or more at time
+ * now, and returns how many bytes that was. Caller must hold a->lock. */
+static size_t arena_purge(struct arena* a, unsigned now, unsigned age) {
+    struct list_elem* e;
+    struct block_header* b;
+    struct purge_info* info;
+    size_t len, purged = 0;
+    char* lo;
+    int fl, sl, fl_min, sl_min;
+
+    a->last_purge = now;
+    mapping_insert(PURGE_MIN, &fl_min, &sl_min);
+    for (fl = fl_min; fl < FL_COUNT && a->purge_pending > 0; fl++) {
+        if (!(a->fl_bitmap & ((size_t) 1 << fl)))
+            continue;
+        for (sl = fl == fl_min ? sl_min : 0; sl < SL_COUNT; sl++) {
+            if (!(a->sl_bitmap[fl] & (1u << sl)))
+                continue;
+            for (e = list_begin(&a->free_lists[fl][sl]); e != list_end(&a->free_lists[fl][sl]);
+                    e = list_next(e)) {
+                b = header_from_node(e);
+                info = purge_info(b);
+                if (block_size(b) < PURGE_MIN || info->purged || now - info->freed_at < age)
+                    continue;
+                len = purge_range(b, &lo);
+                mem_purge(lo, len);
+                info->purged = true;
+                a->purge_pending--;
+                purged += len;
+            }
+        }
+    }
+    return purged;
+}
+
+/* 
+ * heap_malloc - Allocate a block from the free lists, or by incrementing the brk pointer.
+ *     Always allocate a block whose size is a multiple of the alignment. If zero isn't NULL,
+ *     it gets a run of the payload known to read as zeros, if there is one.
+ *     Caller must hold a->lock.
+ */
+static void *heap_malloc(struct arena* a, size_t size, struct zero_run* zero)
+{
+    remote_drain(a, &a->remote);
+
+    void* reused = malloc_freelist(a, size, zero);
+    if (reused == NULL && DEFERRED_COALESCE && a->deferred_frees >= COALESCE_THRESHOLD) {
+        arena_coalesce(a);
+        reused = malloc_freelist(a, size, zero);
+    }
+    if (reused != NULL)
+        return reused;
+
+    struct block_header * blk = arena_grow(a, adjust_size(size), zero);
+    if (blk == NULL)
+        return NULL;
+
+    return blk->payload;
+}
+
+/*
+ * heap_free - Put a block back on the free list of its arena a, after merging it with
+ *     whichever of its neighbours are free, unless merging is deferred. A large enough free
+ *     block at the top of the heap is trimmed, and large free blocks that have waited long
+ *     enough are purged. Caller must hold a->lock.
+ */
+static void heap_free(struct arena* a, void *ptr)
+{
+
+    struct block_header* header = header_from_node((struct list_elem*) ptr);
+    struct block_header* next_header = next_block(header);
+    struct block_header* prev_header;
+    size_t size = block_size(header);
+
+    if (DEFERRED_COALESCE) {
+        a->deferred_frees++;
+    } else {
+        if (prev_free(header)) {
+            prev_header = prev_block(header);
+            remove_free_block(a, prev_header);
+            size += block_size(prev_header);
+            if (header == a->last_header)
+                a->last_header = prev_header;
+            header = prev_header;
+        }
+        /* the epilogue closing each region is never free */
+        if (block_free(next_header)) {
+            remove_free_block(a, next_header);
+            size += block_size(next_header);
+            if (next_header == a->last_header)
+                a->last_header = header;
         }
-        cur = list_next(cur);
-        count++;
     }
-    /* exit loops either not finding one or cur = valid node */
-    if (count < 10 && cur != tail) {
-        cur_header = header_from_node(cur);
-        cur_header->free = false;
-        list_remove((struct list_elem*) cur);
-        return cur;
+    set_free(header, size);
+    insert_free_block(a, header);
+
+    /* keep a chunk, so the next growth doesn't go straight back to the system */
+    if (header == a->last_header && size >= TRIM_THRESHOLD)
+        arena_trim(a, HEAP_CHUNK);
+
+    if (a->purge_pending > 0) {
+        unsigned now = purge_clock();
+        if (now - a->last_purge >= PURGE_DECAY_MS)
+            arena_purge(a, now, PURGE_DECAY_MS);
     }
+}
+
+/* Carves up to n blocks of size bytes out of as few free blocks, or as few stretches of new heap,
+ * as it can. Stores their payloads in out and returns how many it got. Caller must hold a->lock. */
+static size_t heap_malloc_batch(struct arena* a, size_t size, size_t n, void** out) {
+    struct block_header* header;
+    struct block_header* next;
+    size_t asize = adjust_size(size);
+    size_t per_chunk = MMAP_THRESHOLD / asize > 1 ? MMAP_THRESHOLD / asize : 1;
+    size_t i = 0, want, rest;
+
+    remote_drain(a, &a->remote);
+    while (i < n) {
+        want = asize * (n - i < per_chunk ? n - i : per_chunk);
+        header = find_free_block(a, want);
+        if (header == NULL)
+            header = find_free_block(a, asize);
+        if (header != NULL) {
+            remove_free_block(a, header);
+            set_used(header, block_size(header));
+        } else if (DEFERRED_COALESCE && a->deferred_frees >= COALESCE_THRESHOLD) {
+            arena_coalesce(a);
+            continue;
+        } else if ((header = arena_grow(a, want, NULL)) == NULL) {
+            break;
+        }
+
+        /* cut consecutive blocks off the front while more are wanted. Each new header is
+         * written before set_used reads it, so a fresh page faults in once, not twice. */
+        while (i < n - 1 && block_size(header) >= 2 * asize) {
+            rest = block_size(header) - asize;
+            next = (struct block_header*) ((char*) header + asize);
+            next->size = rest;
+            set_used(header, asize);
+            if (header == a->last_header)
+                a->last_header = next;
+            out[i++] = header->payload;
+            header = next;
+        }
+        split_block(a, header, asize);
+        out[i++] = header->payload;
+    }
+    return i;
+}
+
+/* Returns the ALIGNMENT step serving requests of size bytes, which numbers both slab classes
+ * and thread cache stacks. A request for 0 bytes gets the first. */
+static size_t size_step(size_t size) {
+    return (size - (size != 0)) / ALIGNMENT;
+}
+
+/* Returns the slab class serving requests of size bytes */
+static int slab_class(size_t size) {
+    return size_step(size);
+}
+
+/* Returns the lock that requests of size bytes from a are served under: the lock of their slab
+ * class if they come from slabs, else the arena lock */
+static pthread_mutex_t* size_lock(struct arena* a, size_t size) {
+    if (USE_SLABS && size <= SLAB_MAX)
+        return &a->classes[slab_class(size)].lock;
+    return &a->lock;
+}
+
+/* Returns the lock guarding the block with payload ptr, owned by a */
+static pthread_mutex_t* block_lock(struct arena* a, void* ptr) {
+    struct slab* sl = slab_of(ptr);
 
-    return NULL;
+    return sl != NULL ? &a->classes[slab_class(sl->size)].lock : &a->lock;
+}
+
+/* Sets up an empty slab for class cls, reusing an empty slab page of a if there is one.
+ * Caller must hold the lock of class cls, and not a->lock. */
+static struct slab* slab_new(struct arena* a, int cls) {
+    struct block_header* blk;
+    struct slab* sl = NULL;
+    int i;
+
+    pthread_mutex_lock(&a->lock);
+    if (!list_empty(&a->free_slabs)) {
+        sl = list_entry(list_pop_front(&a->free_slabs), struct slab, elem);
+        a->free_slab_count--;
+    } else if ((blk = arena_grow_page(a)) != NULL) {
+        sl = (struct slab*) blk->payload;
+        arena_map[((char*) sl - heap_base) / ARENA_PAGE] |= MAP_SLAB;
+    }
+    pthread_mutex_unlock(&a->lock);
+    if (sl == NULL)
+        return NULL;
+    sl->size = (cls + 1) * ALIGNMENT;
+    sl->nobjs = (ARENA_PAGE - sizeof(struct block_header) - offsetof(struct slab, objs)) / sl->size;
+    sl->nfree = sl->nobjs;
+    memset(sl->free_bits, 0, sizeof(sl->free_bits));
+    for (i = 0; i < sl->nobjs; i++)
+        sl->free_bits[i / 32] |= 1u << (i % 32);
+    list_push_front(&a->classes[cls].slabs, &sl->elem);
+    return sl;
+}
+
+/* Takes an object of class cls from a slab of a, making a new slab only if grow is set.
+ * Caller must hold the lock of class cls. */
+static void* slab_malloc(struct arena* a, int cls, bool grow) {
+    struct slab* sl;
+    int i, bit;
+
+    remote_drain(a, &a->classes[cls].remote);
+    if (!list_empty(&a->classes[cls].slabs))
+        sl = list_entry(list_front(&a->classes[cls].slabs), struct slab, elem);
+    else if (!grow || (sl = slab_new(a, cls)) == NULL)
+        return NULL;
+
+    for (i = 0; sl->free_bits[i] == 0; i++)
+        ;
+    bit = __builtin_ctz(sl->free_bits[i]);
+    sl->free_bits[i] &= ~(1u << bit);
+    if (--sl->nfree == 0)
+        list_remove(&sl->elem);
+    return sl->objs + (i * 32 + bit) * sl->size;
+}
+
+/* Frees the page of sl, an empty slab of a, as an ordinary heap block. Caller must hold a->lock. */
+static void slab_release(struct arena* a, struct slab* sl) {
+    arena_map[((char*) sl - heap_base) / ARENA_PAGE] &= ~MAP_SLAB;
+    heap_free(a, sl);
+}
+
+/* Returns an object to its slab sl of arena a. A slab that becomes empty is kept for any
+ * class while a has room for it, unless it is the last one left for its own, and else freed.
+ * Caller must hold the lock of the slab's class, and not a->lock. */
+static void slab_free(struct arena* a, struct slab* sl, void* ptr) {
+    int idx = ((char*) ptr - sl->objs) / sl->size;
+    struct list* l = &a->classes[slab_class(sl->size)].slabs;
+
+    sl->free_bits[idx / 32] |= 1u << (idx % 32);
+    if (sl->nfree++ == 0)
+        list_push_front(l, &sl->elem);
+    if (sl->nfree == sl->nobjs && list_front(l) != list_back(l)) {
+        list_remove(&sl->elem);
+        pthread_mutex_lock(&a->lock);
+        if (a->free_slab_count < SLAB_POOL) {
+            list_push_front(&a->free_slabs, &sl->elem);
+            a->free_slab_count++;
+        } else {
+            slab_release(a, sl);
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+/* Frees the pages of all empty slabs of class cls of a, the last one included. Caller must hold
+ * the lock of class cls, and not a->lock. */
+static void slab_trim(struct arena* a, int cls) {
+    struct list* l = &a->classes[cls].slabs;
+    struct list_elem* e = list_begin(l);
+    struct slab* sl;
+
+    while (e != list_end(l)) {
+        sl = list_entry(e, struct slab, elem);
+        if (sl->nfree < sl->nobjs) {
+            e = list_next(e);
+            continue;
+        }
+        e = list_remove(e);
+        pthread_mutex_lock(&a->lock);
+        slab_release(a, sl);
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+/* Allocates size bytes from a, from a slab if small enough. Caller must hold
+ * size_lock(a, size). */
+static void* arena_malloc(struct arena* a, size_t size) {
+    if (USE_SLABS && size <= SLAB_MAX)
+        return slab_malloc(a, slab_class(size), true);
+    return heap_malloc(a, size, NULL);
+}
+
+/* Returns ptr to a, the arena owning it. Caller must hold block_lock(a, ptr). */
+static void arena_free(struct arena* a, void* ptr) {
+    struct slab* sl = slab_of(ptr);
+
+    if (sl != NULL)
+        slab_free(a, sl, ptr);
+    else
+        heap_free(a, ptr);
+}
+
+/* Returns true if the calling thread doesn't own the blocks of a: it allocates from another
+ * arena, or from none yet */
+static bool is_remote(struct arena* a) {
+    return a != thread_arena;
+}
+
+/* Queues ptr, owned by a, to be freed by the next allocation under block_lock(a, ptr). Takes no
+ * lock, and touches nothing of a's but the queue. */
+static void remote_free(struct arena* a, void* ptr) {
+    struct slab* sl = slab_of(ptr);
+    struct remote_queue* q = sl != NULL ? &a->classes[slab_class(sl->size)].remote : &a->remote;
+    void* head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+    do
+        *(void**) ptr = head;
+    while (!__atomic_compare_exchange_n(&q->head, &head, ptr, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Frees every block waiting on q, a remote queue of a. Caller must hold the lock q belongs to. */
+static void remote_drain(struct arena* a, struct remote_queue* q) {
+    void* ptr;
+    void* next;
+
+    if (__atomic_load_n(&q->head, __ATOMIC_RELAXED) == NULL)
+        return;
+    for (ptr = __atomic_exchange_n(&q->head, NULL, __ATOMIC_ACQUIRE); ptr != NULL; ptr = next) {
+        next = *(void**) ptr;
+        arena_free(a, ptr);
+    }
+}
+
+/* Returns the length of a mapping holding a block of size payload bytes whose header
+ * sits pad bytes in */
+static size_t mmap_length(size_t size, size_t pad) {
+    size_t pagesize = mem_pagesize();
+    return (size + pad + sizeof(struct block_header) + pagesize - 1) & ~(pagesize - 1);
+}
+
+/* Returns how far into its mapping the header of a mapped block sits. Payloads never start
+ * past the first page, so that is the header's offset in its page. */
+static size_t mmap_pad(struct block_header* header) {
+    return (size_t) header & (mem_pagesize() - 1);
+}
+
+/* Gives a request of size bytes a mapping of its own, with the payload aligned to align.
+ * The payload starts at the first boundary of align, or of ALIGNMENT if that's larger, in
+ * the mapping. Alignments past a page put the payload at the end of the first page, and
+ * the mapping is placed to suit. The block runs to the end of the mapping. */
+static void* mmap_malloc(size_t size, size_t align) {
+    size_t pagesize = mem_pagesize();
+    size_t off = align < ALIGNMENT ? ALIGNMENT : align > pagesize ? pagesize : align;
+    size_t pad = off - sizeof(struct block_header);
+    size_t len;
+    struct block_header* header;
+    char* map;
+
+    if (size > SIZE_MAX / 2)
+        return NULL;
+    len = mmap_length(size, pad);
+    pthread_mutex_lock(&brk_lock);
+    map = align > pagesize ? mem_map_aligned(len, align, off) : mem_map(len);
+    pthread_mutex_unlock(&brk_lock);
+    if (map == NULL)
+        return NULL;
+    header = (struct block_header*) (map + pad);
+    header->size = (len - pad) | BLOCK_MAPPED;
+    return header->payload;
+}
+
+/* Unmaps a block given out by mmap_malloc */
+static void mmap_free(void* ptr) {
+    struct block_header* header = header_from_node((struct list_elem*) ptr);
+    size_t pad = mmap_pad(header);
+
+    assert(header->size & BLOCK_MAPPED);
+    pthread_mutex_lock(&brk_lock);
+    mem_unmap((char*) header - pad, block_size(header) + pad);
+    pthread_mutex_unlock(&brk_lock);
+}
+
+/* Resizes a block given out by mmap_malloc to hold size bytes. The system moves its pages
+ * if it has to, so nothing is copied, but only the payload's page offset is kept. Returns the
+ * new payload, or NULL with the block untouched. */
+static void* mmap_realloc(void* ptr, size_t size) {
+    struct block_header* header = header_from_node((struct list_elem*) ptr);
+    size_t pad = mmap_pad(header);
+    size_t old_len = block_size(header) + pad;
+    size_t len;
+    char* map;
+
+    if (size > SIZE_MAX / 2)
+        return NULL;
+    len = mmap_length(size, pad);
+    if (len == old_len)
+        return ptr;
+    pthread_mutex_lock(&brk_lock);
+    map = mem_remap((char*) header - pad, old_len, len);
+    pthread_mutex_unlock(&brk_lock);
+    if (map == NULL)
+        return NULL;
+    header = (struct block_header*) (map + pad);
+    header->size = (len - pad) | BLOCK_MAPPED;
+    return header->payload;
+}
+
+/* Returns the number of payload bytes usable at ptr */
+static size_t usable_size(void* ptr) {
+    struct slab* sl;
+
+    if (is_mapped(ptr))
+        return block_size(header_from_node((struct list_elem*) ptr)) - sizeof(struct block_header);
+    sl = slab_of(ptr);
+    if (sl != NULL)
+        return sl->size;
+    return block_size(header_from_node((struct list_elem*) ptr)) - sizeof(struct block_header);
+}
+
+/* Returns this thread's cache, emptied first if it was filled before the last mm_init */
+static struct tcache* tcache_get(void) {
+    if (tcache.epoch != heap_epoch) {
+        memset(tcache.bins, 0, sizeof(tcache.bins));
+        tcache.grow_ptr = NULL;
+        tcache.epoch = heap_epoch;
+        /* armed first: setting a key may allocate, and come back here */
+        if (!tcache.armed) {
+            tcache.armed = true;
+            pthread_once(&tcache_key_once, tcache_key_init);
+            pthread_setspecific(tcache_key, &tcache);
+        }
+    }
+    return &tcache;
+}
+
+/* Returns the cache stack serving requests of size bytes, or -1 if the size isn't cached */
+static int tcache_index(size_t size) {
+    return size > TCACHE_MAX ? -1 : size_step(size);
+}
+
+static void tcache_push(struct tcache_bin* bin, void* ptr) {
+    *(void**) ptr = bin->head;
+    bin->head = ptr;
+    bin->count++;
+}
+
+static void* tcache_pop(struct tcache_bin* bin) {
+    void* ptr = bin->head;
+    bin->head = *(void**) ptr;
+    bin->count--;
+    return ptr;
+}
+
+/* Serves a miss on stack idx: allocates one block for the caller and pulls up to
+ * TCACHE_BATCH - 1 more blocks of the same class off the free lists, all under one lock */
+static void* tcache_refill(struct tcache_bin* bin, int idx) {
+    size_t size = (idx + 1) * ALIGNMENT;
+    struct arena* a = arena_get();
+    pthread_mutex_t* lock = size_lock(a, size);
+    void* ptr;
+    void* extra;
+    int n;
+
+    pthread_mutex_lock(lock);
+    ptr = arena_malloc(a, size);
+    for (n = 1; ptr != NULL && n < TCACHE_BATCH && bin->count < TCACHE_COUNT; n++) {
+        if (USE_SLABS && size <= SLAB_MAX) {
+            extra = slab_malloc(a, slab_class(size), false);
+        } else {
+            /* only reuse free memory, never grow the heap for extras */
+            extra = malloc_freelist(a, size, NULL);
+        }
+        if (extra == NULL)
+            break;
+        tcache_push(bin, extra);
+    }
+    pthread_mutex_unlock(lock);
+    return ptr;
+}
+
+/* Returns TCACHE_BATCH blocks of a full stack to the free lists of their arenas,
+ * taking each lock once per run of blocks it guards. Other arenas' blocks are queued. */
+static void tcache_flush(struct tcache_bin* bin) {
+    pthread_mutex_t* locked = NULL;
+    pthread_mutex_t* lock;
+    struct arena* a;
+    void* ptr;
+    int n;
+
+    for (n = 0; n < TCACHE_BATCH && bin->head != NULL; n++) {
+        ptr = tcache_pop(bin);
+        a = arena_of(ptr);
+        if (is_remote(a)) {
+            remote_free(a, ptr);
+            continue;
+        }
+        lock = block_lock(a, ptr);
+        if (lock != locked) {
+            if (locked != NULL)
+                pthread_mutex_unlock(locked);
+            pthread_mutex_lock(lock);
+            locked = lock;
+        }
+        arena_free(a, ptr);
+    }
+    if (locked != NULL)
+        pthread_mutex_unlock(locked);
+}
+
+/* Returns every block in tc to its arena */
+static void tcache_empty(struct tcache* tc) {
+    int i;
+
+    for (i = 0; i < TCACHE_CLASSES; i++)
+        while (tc->bins[i].head != NULL)
+            tcache_flush(&tc->bins[i]);
+}
+
+/* Destructor of tcache_key: empties the cache of an exiting thread, whose blocks would
+ * otherwise stay allocated for good */
+static void tcache_exit(void* arg) {
+    tcache_empty(tcache_get());
+}
+
+static void tcache_key_init(void) {
+    pthread_key_create(&tcache_key, tcache_exit);
 }
 
 /* 
- * mm_malloc - Allocate a block by incrementing the brk pointer.
- *     Always allocate a block whose size is a multiple of the alignment.
+ * mm_malloc - Allocate a block, from the thread cache if possible.
  */
 void *mm_malloc(size_t size)
 {
-    void* reused = malloc_freelist(size);
-    if (reused != NULL) {
-        struct block_header* header = header_from_node((struct list_elem*) reused);
-        if(header->free){
-            header->free = false;
-            if (header != last_header) {
-                next_block(header)->prev_size = header->size;
+    int idx = tcache_index(size);
+    struct arena* a;
+    void* ptr;
+
+    if (idx >= 0) {
+        struct tcache_bin* bin = &tcache_get()->bins[idx];
+        if (bin->head != NULL)
+            return tcache_pop(bin);
+        return tcache_refill(bin, idx);
+    }
+    if (size >= MMAP_THRESHOLD)
+        return mmap_malloc(size, ALIGNMENT);
+
+    a = arena_get();
+    pthread_mutex_lock(size_lock(a, size));
+    ptr = arena_malloc(a, size);
+    pthread_mutex_unlock(size_lock(a, size));
+    return ptr;
+}
+
+/*
+ * mm_malloc_batch - Allocates n blocks of size bytes each, storing them in out. The thread
+ *     cache is drained first, and the rest come from one arena under a single lock, carved
+ *     from as few free blocks as possible. Returns how many blocks it allocated, which is
+ *     less than n only if memory ran out.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+    int idx = tcache_index(size);
+    struct tcache_bin* bin;
+    struct arena* a;
+    size_t i = 0;
+
+    if (idx >= 0) {
+        bin = &tcache_get()->bins[idx];
+        while (i < n && bin->head != NULL)
+            out[i++] = tcache_pop(bin);
+        size = (idx + 1) * ALIGNMENT;
+    }
+    if (size >= MMAP_THRESHOLD) {
+        while (i < n && (out[i] = mmap_malloc(size, ALIGNMENT)) != NULL)
+            i++;
+        return i;
+    }
+
+    a = arena_get();
+    pthread_mutex_lock(size_lock(a, size));
+    if (USE_SLABS && size <= SLAB_MAX) {
+        while (i < n && (out[i] = slab_malloc(a, slab_class(size), true)) != NULL)
+            i++;
+    } else if (i < n) {
+        i += heap_malloc_batch(a, size, n - i, out + i);
+    }
+    pthread_mutex_unlock(size_lock(a, size));
+    return i;
+}
+
+/*
+ * mm_free_batch - Frees the n blocks in ptrs, skipping NULLs. Blocks top up the thread cache
+ *     first, and the rest go back to their arenas, taking each lock once per run of blocks
+ *     it guards. Other arenas' blocks are queued for their owners instead.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    struct tcache* tc = tcache_get();
+    struct tcache_bin* bin;
+    pthread_mutex_t* locked = NULL;
+    pthread_mutex_t* lock;
+    struct arena* a;
+    size_t i, size;
+    void* ptr;
+
+    for (i = 0; i < n; i++) {
+        ptr = ptrs[i];
+        if (ptr == NULL)
+            continue;
+        if (is_mapped(ptr)) {
+            mmap_free(ptr);
+            continue;
+        }
+        size = usable_size(ptr);
+        if (size >= ALIGNMENT && size <= TCACHE_MAX) {
+            bin = &tc->bins[size / ALIGNMENT - 1];
+            if (bin->count < TCACHE_COUNT) {
+                tcache_push(bin, ptr);
+                continue;
             }
         }
-        return reused;
+        a = arena_of(ptr);
+        if (is_remote(a)) {
+            remote_free(a, ptr);
+            continue;
+        }
+        lock = block_lock(a, ptr);
+        if (lock != locked) {
+            if (locked != NULL)
+                pthread_mutex_unlock(locked);
+            pthread_mutex_lock(lock);
+            locked = lock;
+        }
+        arena_free(a, ptr);
     }
+    if (locked != NULL)
+        pthread_mutex_unlock(locked);
+}
 
-    int newsize = roundup(size + sizeof(struct block_header));
+/*
+ * mm_malloc_at_least - mm_malloc that also stores in *actual, if not NULL, how many bytes
+ *     the returned block can really hold.
+ */
+void *mm_malloc_at_least(size_t size, size_t *actual)
+{
+    void* ptr = mm_malloc(size);
 
-    struct block_header * blk = mem_sbrk(newsize);
-    if (blk == NULL)
+    if (ptr != NULL && actual != NULL)
+        *actual = usable_size(ptr);
+    return ptr;
+}
+
+/*
+ * mm_malloc_usable_size - Returns how many bytes the block at ptr can hold, which may be
+ *     more than were asked for. Returns 0 for NULL.
+ */
+size_t mm_malloc_usable_size(void *ptr)
+{
+    return ptr == NULL ? 0 : usable_size(ptr);
+}
+
+/*
+ * mm_good_size - Returns the usable size mm_malloc gives at least for a request of size
+ *     bytes, so callers can round their requests up to it and waste nothing.
+ */
+size_t mm_good_size(size_t size)
+{
+    size_t pad = ALIGNMENT - sizeof(struct block_header);
+
+    if (size >= MMAP_THRESHOLD)
+        return size > SIZE_MAX / 2 ? size : mmap_length(size, pad) - pad - sizeof(struct block_header);
+    /* the thread cache asks for the size of its class */
+    if (tcache_index(size) >= 0)
+        size = (tcache_index(size) + 1) * ALIGNMENT;
+    if (USE_SLABS && size <= SLAB_MAX)
+        return (slab_class(size) + 1) * ALIGNMENT;
+    return adjust_size(size) - sizeof(struct block_header);
+}
+
+/*
+ * mm_calloc - Allocates zeroed memory for nmemb objects of size bytes each. Only the bytes not
+ *     known to be zero already are cleared: fresh mappings, heap never handed out before, and
+ *     pages purged while the block was free all read as zeros.
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    struct zero_run zero = { NULL, NULL };
+    struct arena* a;
+    size_t total;
+    char* ptr;
+
+    if (size != 0 && nmemb > SIZE_MAX / size)
         return NULL;
+    total = nmemb * size;
+    if (total >= MMAP_THRESHOLD)
+        return mmap_malloc(total, ALIGNMENT);
+    /* cached and slab sized requests are small enough to just clear */
+    if (tcache_index(total) >= 0 || (USE_SLABS && total <= SLAB_MAX)) {
+        ptr = mm_malloc(total);
+        if (ptr != NULL)
+            memset(ptr, 0, total);
+        return ptr;
+    }
 
-    blk->size = newsize - sizeof(struct block_header);
-    blk->free = false;
-    blk->prev_size = last_header->size;
-    last_header = blk;
-    return blk->payload;
+    a = arena_get();
+    pthread_mutex_lock(&a->lock);
+    ptr = heap_malloc(a, total, &zero);
+    pthread_mutex_unlock(&a->lock);
+    if (ptr == NULL)
+        return NULL;
+    if (zero.lo < ptr)
+        zero.lo = ptr;
+    if (zero.hi > ptr + total)
+        zero.hi = ptr + total;
+    if (zero.lo >= zero.hi) {
+        memset(ptr, 0, total);
+    } else {
+        memset(ptr, 0, zero.lo - ptr);
+        memset(zero.hi, 0, ptr + total - zero.hi);
+    }
+    return ptr;
 }
-/* set the next headers prev's free unless the current header's the last header*/
 
 /*
- * mm_free - Freeing a block does nothing.
+ * mm_free - Freeing a block caches it for this thread, or returns it to the free lists.
  */
 void mm_free(void *ptr)
 {
+    size_t size = usable_size(ptr);
+    pthread_mutex_t* lock;
+    struct arena* a;
 
-    struct block_header* header = header_from_node((struct list_elem*) ptr);
-    struct list* l = &free_lists[get_free_list(header->size)];
-    
-    list_push_front (l, (struct list_elem*) ptr);
-    header->free = true;
+    /* blocks are cached by the largest class they can serve */
+    if (size >= ALIGNMENT && size <= TCACHE_MAX) {
+        struct tcache_bin* bin = &tcache_get()->bins[size / ALIGNMENT - 1];
+        if (bin->count >= TCACHE_COUNT)
+            tcache_flush(bin);
+        tcache_push(bin, ptr);
+        return;
+    }
+
+    if (is_mapped(ptr)) {
+        mmap_free(ptr);
+        return;
+    }
+
+    /* the block goes back to its owner, queued if we allocate from another arena. Once freed,
+     * an emptied slab may change class, so its lock is looked up before. */
+    a = arena_of(ptr);
+    if (is_remote(a)) {
+        remote_free(a, ptr);
+        return;
+    }
+    lock = block_lock(a, ptr);
+    pthread_mutex_lock(lock);
+    arena_free(a, ptr);
+    pthread_mutex_unlock(lock);
 }
 
 /*
- * mm_realloc - Implemented simply in terms of mm_malloc and mm_free
+ * mm_free_sized - mm_free for callers that still know the size they asked for. Cached sizes
+ *     are binned by that size, so the block's header, slab and arena are never read.
  */
-void *mm_realloc(void *oldptr, size_t size)
+void mm_free_sized(void *ptr, size_t size)
+{
+    struct tcache_bin* bin;
+
+#ifdef DEBUG
+    assert(size <= usable_size(ptr));
+#endif
+    /* the block can serve at least the class size rounds down to, whatever it really holds.
+     * Small blocks are mapped only by over-aligned memalign, and those are not cached. */
+    if (size >= ALIGNMENT && size <= TCACHE_MAX && !is_mapped(ptr)) {
+        bin = &tcache_get()->bins[size / ALIGNMENT - 1];
+        if (bin->count >= TCACHE_COUNT)
+            tcache_flush(bin);
+        tcache_push(bin, ptr);
+        return;
+    }
+    /* larger sizes say nothing about where the block lives: realloc grows heap blocks past
+     * MMAP_THRESHOLD in place */
+    mm_free(ptr);
+}
+
+/*
+ * realloc_inplace - Tries to grow the block into its next neighbour or past the brk, and failing
+ *     that into its free previous neighbour, sliding the payload down. The block keeps up to
+ *     reserve bytes of payload if there is room. Returns the payload of the grown block, or NULL.
+ *     Caller must hold the lock of a, the arena owning the block.
+ */
+static void* realloc_inplace(struct arena* a, struct block_header* header, size_t size,
+                             size_t reserve)
 {
-    struct block_header* header = header_from_node((struct list_elem*) oldptr);
-    struct block_header* prev_header = prev_block(header);
     struct block_header* next_header = next_block(header);
-    
-    if(header->size >= size){
-        return oldptr;
+    struct block_header* prev_header;
+    size_t old_size = block_size(header);
+    size_t new_size = old_size;
+    bool merge_next = false;
+
+    /* callers bound size, but the slack on top of it may not fit. The block is then grown to
+     * size alone, which also keeps reserve - old_size from wrapping below. */
+    if (reserve < size || reserve > SIZE_MAX / 2)
+        reserve = size;
+    size = adjust_size(size);
+    reserve = adjust_size(reserve);
+    /* the epilogue closing each region is never free */
+    if (block_free(next_header))
+        new_size += block_size(next_header);
+    /* at the top of the arena, the wilderness grows until the block fits */
+    if (new_size < reserve
+            && (header == a->last_header || (next_header == a->last_header && block_free(next_header)))
+            && (arena_extend(a, reserve - old_size) || arena_extend(a, size - old_size))) {
+        next_header = next_block(header);
+        new_size = old_size + block_size(next_header);
+    }
+    if (block_free(next_header)) {
+        merge_next = true;
+        if (new_size >= size) {
+            remove_free_block(a, next_header);
+            set_used(header, new_size);
+            if (next_header == a->last_header)
+                a->last_header = header;
+            split_block(a, header, reserve);
+            wild_carved(a, header);
+            return header->payload;
+        }
     }
 
-    int new_size = prev_header->size + header->size + sizeof(struct block_header);
-    /*if(prev_header->free &&  new_size >= size){
-        remove_from_list(prev_header);
-        prev_header->size = new_size;
-        prev_header->free = false;
-        assert(header->free == false);
-
-        memcpy(prev_header->payload, oldptr, new_size);
-        return prev_header->payload;
-    }*/
-
-    
-    
-    if(header != last_header){
-        new_size = next_header->size + header->size + sizeof(struct block_header);
-        if(next_header->free && new_size >= size){
-            list_remove((struct list_elem*) next_header->payload);
-            if(next_header == last_header){
-                last_header = header;
-            }else{
-                next_header->prev_size = new_size;
+    if (!prev_free(header))
+        return NULL;
+    prev_header = prev_block(header);
+    new_size += block_size(prev_header);
+    if (new_size < size)
+        return NULL;
+    remove_free_block(a, prev_header);
+    if (merge_next) {
+        remove_free_block(a, next_header);
+        if (next_header == a->last_header)
+            a->last_header = prev_header;
+    }
+    if (header == a->last_header)
+        a->last_header = prev_header;
+    memmove(prev_header->payload, header->payload, old_size - sizeof(struct block_header));
+    set_used(prev_header, new_size);
+    split_block(a, prev_header, reserve);
+    wild_carved(a, prev_header);
+    return prev_header->payload;
+}
+
+/* Gives the part of an allocated block past size bytes back to the free lists, merged with a
+ * free next block. Caller must hold a->lock. */
+static void shrink_block(struct arena* a, struct block_header* header, size_t size) {
+    struct block_header* tail;
+    size_t rest = block_size(header) - size;
+
+    if (rest < MIN_BLOCK)
+        return;
+    set_used(header, size);
+    tail = next_block(header);
+    tail->size = rest;
+    if (header == a->last_header)
+        a->last_header = tail;
+    heap_free(a, tail->payload);
+}
+
+/*
+ * mm_trim - Gives free memory back to the system, keeping pad bytes at the top of the heap.
+ *     Blocks in this thread's cache, and those queued for their owners, are returned to their
+ *     arenas first, which may trim on its own, and so are all empty slab pages. The heap then
+ *     shrinks through every arena's empty top regions for as long as it can, and the whole
+ *     pages inside the free blocks left are purged. Returns 1 if any memory was released, else 0.
+ */
+int mm_trim(size_t pad)
+{
+    struct tcache* tc = tcache_get();
+    struct block_header* wild;
+    size_t before, len, purged = 0;
+    bool shrunk;
+    char* lo;
+    int i, j;
+
+    /* more than the heap can hold keeps all of it, without overflowing adjust_size */
+    if (pad > MAX_HEAP)
+        pad = MAX_HEAP;
+    pthread_mutex_lock(&brk_lock);
+    before = mem_heapsize();
+    pthread_mutex_unlock(&brk_lock);
+
+    tcache_empty(tc);
+    for (i = 0; i < NUM_ARENAS; i++) {
+        /* queued blocks may be all that keeps the top of an arena in use */
+        for (j = 0; j < SLAB_CLASSES; j++) {
+            pthread_mutex_lock(&arenas[i].classes[j].lock);
+            remote_drain(&arenas[i], &arenas[i].classes[j].remote);
+            slab_trim(&arenas[i], j);
+            pthread_mutex_unlock(&arenas[i].classes[j].lock);
+        }
+        pthread_mutex_lock(&arenas[i].lock);
+        remote_drain(&arenas[i], &arenas[i].remote);
+        while (!list_empty(&arenas[i].free_slabs)) {
+            slab_release(&arenas[i], list_entry(list_pop_front(&arenas[i].free_slabs),
+                                                struct slab, elem));
+            arenas[i].free_slab_count--;
+        }
+        /* free runs at the top only become one block once merged */
+        if (DEFERRED_COALESCE && arenas[i].last_header != NULL)
+            arena_coalesce(&arenas[i]);
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+
+    /* dropping the top region of one arena may bring the top of another to the brk */
+    do {
+        shrunk = false;
+        for (i = 0; i < NUM_ARENAS; i++) {
+            pthread_mutex_lock(&arenas[i].lock);
+            pthread_mutex_lock(&brk_lock);
+            while (arena_drop_region(&arenas[i]))
+                shrunk = true;
+            pthread_mutex_unlock(&brk_lock);
+            if (arenas[i].last_header != NULL && arena_trim(&arenas[i], pad))
+                shrunk = true;
+            pthread_mutex_unlock(&arenas[i].lock);
+        }
+    } while (shrunk);
+
+    for (i = 0; i < NUM_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+        purged += arena_purge(&arenas[i], purge_clock(), 0);
+        wild = arenas[i].last_header;
+        if (wild != NULL && block_free(wild) && block_size(wild) >= PURGE_MIN) {
+            len = purge_range(wild, &lo);
+            /* pages wholly above a->fresh read as zeros already, and once the ones below are
+             * purged too the whole wilderness does */
+            if (arenas[i].fresh < lo + len) {
+                len = arenas[i].fresh > lo ? (size_t) (arenas[i].fresh - lo + mem_pagesize() - 1)
+                                             & ~(mem_pagesize() - 1) : 0;
+                if (len > 0)
+                    arenas[i].fresh = lo;
             }
-            assert(header->free == false);
-            header->size = new_size;
-            return oldptr;        
+            mem_purge(lo, len);
+            purged += len;
         }
-    }else{
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
 
-        int diff_size = size - header->size;
-        mem_sbrk(diff_size);
+    pthread_mutex_lock(&brk_lock);
+    i = mem_heapsize() < before || purged > 0;
+    pthread_mutex_unlock(&brk_lock);
+    return i;
+}
 
-        header->size = size;
-        return oldptr;
+/*
+ * mm_fork_prepare - Takes every lock of the allocator, in lock order, so that a fork made
+ *     while other threads are inside it leaves the child a consistent heap. Registered with
+ *     pthread_atfork, together with mm_fork_parent and mm_fork_child.
+ */
+void mm_fork_prepare(void)
+{
+    int i, j;
+
+    for (i = 0; i < NUM_ARENAS; i++)
+        for (j = 0; j < SLAB_CLASSES; j++)
+            pthread_mutex_lock(&arenas[i].classes[j].lock);
+    for (i = 0; i < NUM_ARENAS; i++)
+        pthread_mutex_lock(&arenas[i].lock);
+    pthread_mutex_lock(&brk_lock);
+}
+
+/*
+ * mm_fork_parent - Releases the locks mm_fork_prepare took, in the parent.
+ */
+void mm_fork_parent(void)
+{
+    int i, j;
+
+    pthread_mutex_unlock(&brk_lock);
+    for (i = NUM_ARENAS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&arenas[i].lock);
+    for (i = NUM_ARENAS - 1; i >= 0; i--)
+        for (j = SLAB_CLASSES - 1; j >= 0; j--)
+            pthread_mutex_unlock(&arenas[i].classes[j].lock);
+}
+
+/*
+ * mm_fork_child - Sets up the locks mm_fork_prepare took afresh, in the child, where the
+ *     threads that may have waited on them are gone.
+ */
+void mm_fork_child(void)
+{
+    int i, j;
+
+    pthread_mutex_init(&brk_lock, NULL);
+    for (i = 0; i < NUM_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        for (j = 0; j < SLAB_CLASSES; j++)
+            pthread_mutex_init(&arenas[i].classes[j].lock, NULL);
     }
+}
+
+/*
+ * mm_realloc - Grows in place when a neighbour allows it, else falls back to mm_malloc and mm_free.
+ *     A block grown again right after its last growth gets GROW_RESERVE bytes of slack, so a
+ *     buffer grown a little at a time is copied a logarithmic number of times. Shrinking gives
+ *     the tail back, slack included, unless the block is still growing into its slack.
+ */
+void *mm_realloc(void *oldptr, size_t size)
+{
+    size_t old_size = usable_size(oldptr);
+    struct tcache* tc = tcache_get();
+    bool growing = oldptr == tc->grow_ptr;
+    /* slab objects always move to grow, and mapped blocks shrinking below MMAP_THRESHOLD move
+     * into the heap */
+    bool in_heap = !is_mapped(oldptr) && slab_of(oldptr) == NULL;
+    size_t reserve = size;
+    struct arena* a;
+    void* grown;
 
+    /* no block holds that much, and adjust_size would wrap it to a small size */
+    if (size > SIZE_MAX / 2)
+        return NULL;
 
+    /* mapped blocks that stay large are resized by moving pages, never bytes */
+    if (is_mapped(oldptr) && size >= MMAP_THRESHOLD) {
+        grown = mmap_realloc(oldptr, size);
+        return grown != NULL || size > old_size ? grown : oldptr;
+    }
 
-    void *newptr = mm_malloc(size);
-    if (newptr == NULL)
-      return NULL;
+    if(old_size >= size && !is_mapped(oldptr)){
+        if (growing && size >= tc->grow_size) {
+            tc->grow_size = size;
+        } else if (in_heap) {
+            tc->grow_ptr = NULL;
+            a = arena_of(oldptr);
+            pthread_mutex_lock(&a->lock);
+            shrink_block(a, header_from_node((struct list_elem*) oldptr), adjust_size(size));
+            pthread_mutex_unlock(&a->lock);
+        }
+        return oldptr;
+    }
 
-    /* Assuming 'oldptr' was a '&payload[0]' in an block_header,
-     * determine its start as 'oldblk'.  Then its size can be accessed
-     * more easily.
-    */
+    /* large blocks have mappings of their own, which grow without slack */
+    if (growing && size < MMAP_THRESHOLD)
+        reserve = size + GROW_RESERVE(size);
 
-    struct block_header *oldblk;
-    oldblk = oldptr - offsetof(struct block_header, payload);
+    if (in_heap) {
+        a = arena_of(oldptr);
+        pthread_mutex_lock(&a->lock);
+        grown = realloc_inplace(a, header_from_node((struct list_elem*) oldptr), size, reserve);
+        pthread_mutex_unlock(&a->lock);
+        if (grown != NULL) {
+            tc->grow_ptr = grown;
+            tc->grow_size = size;
+            return grown;
+        }
+    }
+
+    void *newptr = mm_malloc(reserve);
+    if (newptr == NULL)
+      return old_size >= size ? oldptr : NULL;
+    tc->grow_ptr = newptr;
+    tc->grow_size = size;
 
-    size_t copySize = oldblk->size;
+    size_t copySize = old_size;
     if (size < copySize)
       copySize = size;
 
@@ -263,25 +1940,92 @@ void *mm_realloc(void *oldptr, size_t size)
     mm_free(oldptr);
     return newptr;
 }
-/*  returns the free_list index based off the size,
- *  starting at block size of 8, goes up by a power of 2
- */
-int get_free_list(size_t size){
-    int i;
-    size_t startsize = 8;
-    for(i=0; i<NUM_BUCKETS; i++){
-        if(size <= startsize)
-            return i;
-        startsize = startsize << 1;
+/* Allocates size bytes from a with the payload aligned to align, a power of 2 larger than
+ * ALIGNMENT. The block is over-allocated, and the slack in front of the aligned payload and
+ * past its end goes back on the free lists. Caller must hold a->lock. */
+static void* heap_memalign(struct arena* a, size_t align, size_t size) {
+    struct block_header* header;
+    struct block_header* aligned;
+    size_t lead;
+    char* ptr = heap_malloc(a, adjust_size(size) + align + MIN_BLOCK, NULL);
+
+    if (ptr == NULL)
+        return NULL;
+    header = header_from_node((struct list_elem*) ptr);
+    /* the slack in front must be empty or big enough to stand as a free block */
+    lead = -(size_t) ptr & (align - 1);
+    while (lead > 0 && lead < MIN_BLOCK)
+        lead += align;
+    if (lead > 0) {
+        aligned = (struct block_header*) ((char*) header + lead);
+        aligned->size = block_size(header) - lead;
+        set_used(header, lead);
+        if (header == a->last_header)
+            a->last_header = aligned;
+        heap_free(a, header->payload);
+        header = aligned;
     }
-    return NUM_BUCKETS - 1;
+    shrink_block(a, header, adjust_size(size));
+    return header->payload;
+}
+
+/*
+ * mm_memalign - Allocates size bytes at an address that is a multiple of alignment, which
+ *     must be a power of 2. Large requests and alignments get a mapping of their own.
+ */
+void *mm_memalign(size_t alignment, size_t size)
+{
+    struct arena* a;
+    void* ptr;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        return NULL;
+    if (alignment <= ALIGNMENT)
+        return mm_malloc(size);
+    if (size >= MMAP_THRESHOLD || alignment >= MMAP_THRESHOLD)
+        return mmap_malloc(size, alignment);
+
+    a = arena_get();
+    pthread_mutex_lock(&a->lock);
+    ptr = heap_memalign(a, alignment, size);
+    pthread_mutex_unlock(&a->lock);
+    return ptr;
+}
+
+/*
+ * mm_posix_memalign - mm_memalign with the posix_memalign interface. alignment must be a
+ *     power of 2 multiple of sizeof(void*). Returns 0, EINVAL or ENOMEM.
+ */
+int mm_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void* ptr;
+
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    ptr = mm_memalign(alignment, size);
+    if (ptr == NULL)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+/*
+ * mm_aligned_alloc - mm_memalign with the C11 aligned_alloc interface
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size)
+{
+    return mm_memalign(alignment, size);
 }
 
 /* returns true if it exists
  */
 bool exist_in_free(struct block_header* b){
     struct list_elem* blk = (struct list_elem*) b->payload;
-    struct list* l =  &free_lists[get_free_list(b->size)];;
+    struct list* l;
+    int fl, sl;
+
+    mapping_insert(block_size(b), &fl, &sl);
+    l = &arena_of(b->payload)->free_lists[fl][sl];
     struct list_elem* i;
     for(i = list_front(l); i != list_tail(l); i = list_next(i)){
         if(blk == i)
@@ -295,14 +2039,38 @@ bool exist_in_free(struct block_header* b){
  *  If the header sizes are incorrect, it will break, likely segfaulting
  */
 bool mm_check(){
-    struct block_header* cur = (struct block_header*) mem_heap_lo();
-    while(cur != last_header){
-        if(cur->free)
+    struct block_header* cur = mem_heap_lo() + ALIGNMENT - sizeof(struct block_header);
+    bool after_free = false;
+    /* the regions of all arenas tile the heap, so one walk covers them all */
+    while((void*) cur <= mem_heap_hi()){
+        if(prev_free(cur) != after_free)
+            return false;
+        /* every free block is listed, but for the wilderness */
+        if(block_free(cur) && cur != arena_of(cur->payload)->last_header)
             if(!exist_in_free(cur))
                 return false;
+        if(block_free(cur) && prev_block(next_block(cur)) != cur)
+            return false;
+        after_free = block_free(cur);
         cur = next_block(cur);
     }
-    //return the check on the last header
-    return exist_in_free(cur);
+    return true;
+}
+
+#ifdef DEBUG
+/* Checks that reallocating a heap block to a size no block can hold fails and leaves the block
+ * as it was, both with a free block before it and with the wilderness after it */
+static void check_realloc_limits(void) {
+    char* before = mm_malloc(1000);
+    char* ptr = mm_malloc(1000);
+    size_t size = usable_size(ptr);
+
+    memset(ptr, 0x5a, size);
+    mm_free(before);
+    assert(mm_realloc(ptr, SIZE_MAX) == NULL);
+    assert(mm_realloc(ptr, SIZE_MAX - 3) == NULL);
+    assert(usable_size(ptr) == size && ptr[0] == 0x5a && ptr[size - 1] == 0x5a);
+    mm_free(ptr);
 }
+#endif
 // vim: ts=8
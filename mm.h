@@ -3,7 +3,21 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_malloc_at_least(size_t size, size_t *actual);
+extern size_t mm_malloc_usable_size(void *ptr);
+extern size_t mm_good_size(size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern int mm_trim(size_t pad);
+extern void mm_fork_prepare(void);
+extern void mm_fork_parent(void);
+extern void mm_fork_child(void);
 
 
 /* 
@@ -0,0 +1,114 @@
+/*
+ * preload.c - exposes mm as the process malloc. Built into libmm.so
+ *     together with memlib-sys.c, so that
+ *
+ *         LD_PRELOAD=./libmm.so program
+ *
+ *     runs any dynamically linked program on our allocator. Every entry
+ *     point that hands out memory free() may see is replaced, not just
+ *     malloc, or blocks from the libc heap would reach mm_free.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/* Keeps the allocator's locks sane across fork. Done at load time rather than in init, where
+ * pthread_atfork allocating would come back into a pthread_once still in progress. */
+__attribute__((constructor))
+static void setup(void)
+{
+    pthread_atfork(mm_fork_prepare, mm_fork_parent, mm_fork_child);
+}
+
+/* Sets up the heap on the first call into the allocator */
+static void init(void)
+{
+    mem_init(1);
+    if (mm_init() < 0)
+        abort();
+}
+
+/* Returns ptr, setting errno the way malloc does when it is NULL */
+static void *checked(void *ptr)
+{
+    if (ptr == NULL)
+        errno = ENOMEM;
+    return ptr;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    pthread_once(&init_once, init);
+    return checked(mm_malloc(size));
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr != NULL)
+        mm_free(ptr);
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return malloc(size);
+    return checked(mm_realloc(ptr, size));
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    pthread_once(&init_once, init);
+    return checked(mm_calloc(nmemb, size));
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    pthread_once(&init_once, init);
+    return mm_posix_memalign(memptr, alignment, size);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    pthread_once(&init_once, init);
+    return checked(mm_memalign(alignment, size));
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    pthread_once(&init_once, init);
+    return checked(mm_aligned_alloc(alignment, size));
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+
+    return memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    return mm_malloc_usable_size(ptr);
+}